@@ -0,0 +1,498 @@
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <vector>
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkDivideImageFilter.h"
+#include "itksys/SystemTools.hxx"
+#include "AtlasAccumulator.h"
+#include "AtlasTypes.h"
+#include "AtlasOptions.h"
+#include "SubjectWorkerPool.h"
+#include "SubjectCache.h"
+#include "AffineRegistration.h"
+#include "DemonsRegistration.h"
+#include "SnapshotWriter.h"
+#include "AtlasTrace.h"
+#include "ResultStore.h"
+#include "FixedImageCache.h"
+
+// constants
+const unsigned int nDims = 3 ;
+
+// set up types
+typedef itk::Image < atlas::PixelType, nDims > ImageType ;
+typedef itk::Image < atlas::SumPixelType, nDims > SumImageType ;
+typedef itk::ImageFileReader < ImageType > ImageReaderType ;
+typedef itk::ImageFileWriter < ImageType > ImageWriterType ;
+typedef atlas::Accumulator < ImageType, SumImageType > AccumulatorType ;
+typedef itk::DivideImageFilter < SumImageType, SumImageType, ImageType > DivideFilterType ;
+typedef itk::Vector < atlas::FieldComponentType, nDims > VectorPixelType ;
+typedef itk::Image < VectorPixelType, nDims > DisplacementFieldType ;
+typedef atlas::SubjectCache < ImageType > SubjectCacheType ;
+typedef atlas::FixedImageCache < ImageType > FixedImageCacheType ;
+typedef atlas::AffineRegistration < ImageType > AffineRegistrationType ;
+typedef AffineRegistrationType::SettingsType AffineSettings ;
+typedef AffineRegistrationType::AffineTransformType AffineTransformType ;
+
+// subject ID of image i, e.g. KKI2009-05
+std::string SubjectName(int i)
+{
+	std::stringstream o;
+	o << "KKI2009-" << (i < 10 ? "0" : "") << i;
+	return o.str();
+}
+
+// number of subject ID, e.g. 5 for KKI2009-05
+int SubjectNumber(const std::string & subject)
+{
+	return atoi(subject.substr(subject.find('-') + 1).c_str());
+}
+
+// sum / count
+ImageType::Pointer Average(const AccumulatorType & accumulator)
+{
+	DivideFilterType::Pointer divFilter = DivideFilterType::New();
+	divFilter->SetInput(accumulator.GetSum());
+	divFilter->SetConstant(accumulator.GetCount());
+	divFilter->Update();
+	ImageType::Pointer average = divFilter->GetOutput();
+	average->DisconnectPipeline();
+	return average;
+}
+
+void WriteImage(const ImageType * image, const std::string & fname)
+{
+	atlas::TraceStage stage("write", fname);
+	ImageWriterType::Pointer writer = ImageWriterType::New() ;
+	writer->SetFileName( fname ) ;
+	writer->SetInput( image ) ;
+	writer->Update();
+	std::cout << "wrote " << fname << std::endl;
+}
+
+// subject number of the fixed image, 0 if it isn't a subject
+// assumes file name is of the form KKI2009-05-MPRAGE.nii.gz
+int FixedSubject(const std::string & fixedImageFile)
+{
+	int ffn = 0;
+	if (fixedImageFile != "initial") {
+		std::stringstream f(fixedImageFile.size() > 10 ? fixedImageFile.substr(8,2) : "");
+		f >> ffn;
+	}
+	return ffn;
+}
+
+// root mean square intensity difference of two templates on the same grid
+double RMSChange(const ImageType * previous, const ImageType * current)
+{
+	itk::ImageRegionConstIterator < ImageType > pIt(previous, previous->GetBufferedRegion());
+	itk::ImageRegionConstIterator < ImageType > cIt(current, previous->GetBufferedRegion());
+	double sum = 0;
+	for (; !pIt.IsAtEnd(); ++pIt, ++cIt)
+	{
+		double d = static_cast < double >(cIt.Get()) - static_cast < double >(pIt.Get());
+		sum += d * d;
+	}
+	return std::sqrt(sum / previous->GetBufferedRegion().GetNumberOfPixels());
+}
+
+// bookkeeping of an atlas kept for incremental updates (-state=dir): <dir>/state.txt names the generation whose
+// files (in <dir>/<generation>) are current- the initial, affine and deformable sums (initialSum.nrrd,
+// affineSum.nrrd and deformableSum.nrrd shards, whose headers list the subjects), the affine fixed image
+// (fixed.nrrd), the template the deformable sum was registered to at the last full build (reference.nrrd) and
+// the current template (template.nrrd)
+// every save writes a new generation and then switches state.txt to it with one rename, so a crash leaves
+// either the old or the new atlas, never sums that disagree
+struct AtlasState
+{
+	AtlasState() : generation(0), drift(0), refresh(false) {}
+	unsigned int generation ; // 0 --> none yet
+	std::string settings ; // digest of the fixed image name and registration settings the sums were built with
+	double drift ; // RMS intensity change of the template since the last full build
+	bool refresh ; // drift passed -refreshDrift: the next run rebuilds the atlas
+
+	// false if directory holds no state
+	bool Read(const std::string & directory)
+	{
+		std::ifstream file((directory + "/state.txt").c_str());
+		if (!file) {
+			return false;
+		}
+		std::string name;
+		while (file >> name) {
+			if (name == "generation") {
+				file >> generation;
+			} else if (name == "settings") {
+				file >> settings;
+			} else if (name == "drift") {
+				file >> drift;
+			} else if (name == "refresh") {
+				file >> refresh;
+			} else {
+				std::getline(file, name);
+			}
+		}
+		return generation > 0;
+	}
+
+	// written next to the old state and renamed over it
+	void Write(const std::string & directory) const
+	{
+		std::string path = directory + "/state.txt";
+		{
+			std::ofstream file((path + ".new").c_str());
+			file << "generation " << generation << std::endl;
+			file << "settings " << settings << std::endl;
+			file << "drift " << drift << std::endl;
+			file << "refresh " << refresh << std::endl;
+			if (!file) {
+				itkGenericExceptionMacro(<< "could not write " << path);
+			}
+		}
+		if (std::rename((path + ".new").c_str(), path.c_str()) != 0) {
+			itkGenericExceptionMacro(<< "could not rename " << path << ".new");
+		}
+	}
+
+	// directory of the files of the current generation (or of another one)
+	std::string GetFiles(const std::string & directory) const
+	{
+		return GetFiles(directory, generation);
+	}
+	static std::string GetFiles(const std::string & directory, unsigned int generation)
+	{
+		std::stringstream files;
+		files << directory << "/" << generation;
+		return files.str();
+	}
+};
+
+// digest of what the sums of a state depend on besides the subjects: the fixed image (its pixels and geometry, or
+// "initial" for the initial template, which a state stores itself) and the registration settings
+std::string SettingsDigest(const ImageType * fixedImage, const AffineSettings & settings, const atlas::DemonsSettings & demons)
+{
+	atlas::Hash hash;
+	hash.Add(fixedImage ? atlas::GetFixedImageDigest < ImageType >(fixedImage, nullptr) : std::string("initial"));
+	atlas::HashAffineSettings(hash, settings);
+	atlas::HashDemonsSettings(hash, demons);
+	return hash.GetDigest();
+}
+
+// the sums and images as the next generation of the state in stateDirectory, then state.txt switched to it
+void SaveAtlas(const std::string & stateDirectory, AtlasState & state, const AccumulatorType & iAccumulator, const AccumulatorType & tAccumulator,
+	const AccumulatorType & dAccumulator, const ImageType * fixedImage, const ImageType * referenceTemplate, const ImageType * templateImage)
+{
+	unsigned int previous = state.generation;
+	std::string files = AtlasState::GetFiles(stateDirectory, previous + 1);
+	if (itksys::SystemTools::FileIsDirectory(files)) {
+		// left by a run that crashed before switching to it
+		itksys::SystemTools::RemoveADirectory(files);
+	}
+	itksys::SystemTools::MakeDirectory(files);
+	iAccumulator.WriteShard(files + "/initialSum.nrrd", "i");
+	tAccumulator.WriteShard(files + "/affineSum.nrrd", "a");
+	dAccumulator.WriteShard(files + "/deformableSum.nrrd", "d");
+	WriteImage(fixedImage, files + "/fixed.nrrd");
+	WriteImage(referenceTemplate, files + "/reference.nrrd");
+	WriteImage(templateImage, files + "/template.nrrd");
+	state.generation = previous + 1;
+	state.Write(stateDirectory);
+	if (previous > 0) {
+		itksys::SystemTools::RemoveADirectory(AtlasState::GetFiles(stateDirectory, previous));
+	}
+}
+
+ImageType::Pointer ReadImage(const std::string & fname)
+{
+	atlas::TraceStage stage("read", fname);
+	ImageReaderType::Pointer reader = ImageReaderType::New();
+	reader->SetFileName(fname);
+	reader->Update();
+	ImageType::Pointer image = reader->GetOutput();
+	image->DisconnectPipeline();
+	return image;
+}
+
+// incremental update of the atlas in stateDirectory: the subjects that aren't in its sums yet are read, affinely
+// registered to the stored fixed image, deformably registered to the current template and added to the sums,
+// which then give the new templates- one registration per new subject instead of a rebuild of the cohort
+// the template the old subjects were registered to drifts away from the average as subjects are added; once the
+// drift passes refreshDrift (RMS intensity, 0 --> never) the next run rebuilds the atlas
+bool UpdateAtlas(const std::string & stateDirectory, AtlasState & state, const std::vector < int > & subjects, int ffn, const AffineSettings & settings,
+	const atlas::DemonsSettings & demons, const atlas::ResultStore & store, unsigned int jobs, double refreshDrift)
+{
+	std::string files = state.GetFiles(stateDirectory);
+	AccumulatorType iAccumulator, tAccumulator, dAccumulator;
+	iAccumulator.MergeShard(files + "/initialSum.nrrd", "i");
+	tAccumulator.MergeShard(files + "/affineSum.nrrd", "a");
+	dAccumulator.MergeShard(files + "/deformableSum.nrrd", "d");
+	const std::vector < std::string > & known = dAccumulator.GetSubjects();
+	std::vector < int > added;
+	for (size_t k = 0; k < subjects.size(); ++k) {
+		if (std::find(known.begin(), known.end(), SubjectName(subjects[k])) == known.end()) {
+			added.push_back(subjects[k]);
+		}
+	}
+	std::cout << "atlas in " << stateDirectory << ": " << dAccumulator.GetCount() << " subjects, " << added.size() << " new" << std::endl;
+	if (added.empty()) {
+		return true;
+	}
+
+	ImageType::Pointer fixedImage = ReadImage(files + "/fixed.nrrd");
+	ImageType::Pointer templateImage = ReadImage(files + "/template.nrrd");
+	FixedImageCacheType fixedCache(fixedImage, store);
+	FixedImageCacheType templateCache(templateImage);
+	bool ok = atlas::RunSubjects(added, jobs, [&](int i)
+	{
+		std::string is = SubjectName(i);
+		ImageType::Pointer moving = ReadImage(is + "-MPRAGE.nii.gz");
+		iAccumulator.Add(moving, is);
+		AffineTransformType::Pointer transform = AffineTransformType::New();
+		if (i != ffn) {
+			// the fixed subject is already aligned with itself
+			std::cout << "now registering " << is << std::endl;
+			transform = atlas::RegisterAffine(store, is, fixedImage.GetPointer(), moving.GetPointer(), settings, &fixedCache);
+		}
+		ImageType::Pointer affineResult = AffineRegistrationType::Resample(moving, transform, fixedImage, is);
+		tAccumulator.Add(affineResult, is);
+		std::cout << "deformably registering " << is << std::endl;
+		dAccumulator.Add(atlas::RegisterDemons < ImageType, DisplacementFieldType >(store, is, templateImage, affineResult, demons, &templateCache), is);
+		return true;
+	});
+	if (!ok) {
+		// the state is untouched
+		return false;
+	}
+
+	WriteImage(Average(iAccumulator), "initialTemplate.nii.gz");
+	WriteImage(Average(tAccumulator), "affineTemplate.nii.gz");
+	ImageType::Pointer newTemplate = Average(dAccumulator);
+	WriteImage(newTemplate, "deformableAtlas.nii.gz");
+
+	ImageType::Pointer referenceTemplate = ReadImage(files + "/reference.nrrd");
+	state.drift = RMSChange(referenceTemplate, newTemplate);
+	std::cout << "RMS template drift since the last full build " << state.drift << std::endl;
+	if (refreshDrift > 0 && state.drift > refreshDrift) {
+		std::cout << "drift above " << refreshDrift << ", the next run rebuilds the atlas" << std::endl;
+		state.refresh = true;
+	}
+	SaveAtlas(stateDirectory, state, iAccumulator, tAccumulator, dAccumulator, fixedImage, referenceTemplate, newTemplate);
+	return true;
+}
+
+int main(int argc, char * argv[])
+{
+	// assume parameters are expected types and the images are in the build directory i.e. can be accessed directly by filename
+	atlas::Options options;
+	if (argc < 4 || !options.Parse(argc, argv, 4))
+	{
+		std::cout << "check parameters! usage: ./Atlas [-fixedImage=file or initial] [-lower=num] [-upper=num] [options]" << std::endl;
+		std::cout << "builds initialTemplate.nii.gz, affineTemplate.nii.gz and deformableAtlas.nii.gz from KKI2009-lower ... KKI2009-upper in one process, reading every subject once" << std::endl;
+		std::cout << "fixedImage = initial --> affinely register to the initial (mean) template instead of a subject" << std::endl;
+		std::cout << "options: -jobs=num (subjects registered at once, default 1) -threads=num (ITK threads per subject, default cores / jobs) -observe=num{0,1}" << std::endl;
+		std::cout << "trace: -trace=file (.json or .csv: wall/CPU time and peak memory per stage and subject, metric per iteration)" << std::endl;
+		std::cout << "demons: -demonsIterations=num (default 60) -demonsSigma=num (field smoothing in voxels, default 1)" << std::endl;
+		std::cout << "multi-resolution demons: -demonsLevels=num (default 1) -demonsIterations=list (per level, coarsest first) -demonsRMS=num (stop a level below this RMS field change) -demonsPlateau=num (stop a level when the metric improved less than -demonsPlateauTolerance=num, default 0.001, over num iterations)" << std::endl;
+		std::cout << "compact fields: -fieldShrink=num (keep, store and warp with the field on a grid shrunk by num)" << std::endl;
+		std::cout << "foreground: -mask=num{0,1} (register only the padded bounding box of the heads, affine metric inside the fixed foreground) -maskPadding=mm (default 10)" << std::endl;
+		std::cout << "snapshots (observe): -snapshotInterval=num (iterations between snapshots, default 20) -snapshotShrink=num (write on a grid shrunk by num) -snapshotQueue=num (snapshots waiting to be written, default 2)" << std::endl;
+		std::cout << "template: -refinements=num (maximum deformable template iterations, default 1) -tolerance=num (stop once the RMS template change is below, default 0) -compactCache=num{0,1} (cache subjects as float)" << std::endl;
+		std::cout << "reruns: -store=dir (keep each subject's transform and fields; unchanged subjects are skipped, changed ones and later refinements warm-started)" << std::endl;
+		std::cout << "incremental: -state=dir (keep the sums, fixed image and template; a later run with the same dir registers only the subjects of the range not in the atlas yet and updates it) -refreshDrift=num (RMS template drift after which the next run rebuilds, default 0 never) -refresh=num{0,1} (rebuild now; a rebuild registers the range and every subject already in the atlas)" << std::endl;
+		std::cout << "affine: -levels -shrink -sigmas -iterations -steps -sampling -samples -samplePercent -seed -resample -scales -initialize -minimumStep -gradientTolerance -plateau -plateauTolerance as for Registration" << std::endl;
+		std::cout << "example: ./Atlas KKI2009-05-MPRAGE.nii.gz 1 21 -jobs=8 -refinements=4 -tolerance=1" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// parse args
+	std::string fixedImageFile = argv[1];
+	int lower = atoi(argv[2]);
+	int upper = atoi(argv[3]);
+	int observer = options.GetInt("observe", 0);
+	AffineSettings settings;
+	settings.observer = observer;
+	if (!atlas::ReadAffineSettings(options, settings)) {
+		return EXIT_FAILURE;
+	}
+	atlas::DemonsSettings demons;
+	demons.observe = observer;
+	// observer snapshots are warped and written in the background (finishes writing before exit)
+	atlas::SnapshotWriter snapshots(options.GetInt("snapshotQueue", 2));
+	atlas::ReadDemonsSettings(options, demons);
+	demons.snapshotWriter = &snapshots;
+	unsigned int refinements = options.GetInt("refinements", 1);
+	double tolerance = options.GetDouble("tolerance", 0);
+	atlas::ResultStore store(options.GetString("store", ""));
+	atlas::Trace::GetInstance().SetFileName(options.GetString("trace", ""));
+	atlas::TraceStage total("total");
+	unsigned int jobs = options.GetInt("jobs", 1);
+	atlas::SetNumberOfITKThreads(atlas::ITKThreadsPerJob(jobs, options.GetInt("threads", 0)));
+
+	std::vector < int > subjects;
+	for (int i = lower; i <= upper; ++i)
+	{
+		subjects.push_back(i);
+	}
+	if (subjects.empty()) {
+		std::cerr << "no images in range " << lower << " to " << upper << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	// incremental update of an earlier build (-state=dir), unless a rebuild is due
+	std::string stateDirectory = options.GetString("state", "");
+	double refreshDrift = options.GetDouble("refreshDrift", 0);
+	AtlasState state;
+	// the fixed image is read up front, a state is only valid for the same contents
+	ImageType::Pointer fixedFileImage;
+	if (fixedImageFile != "initial") {
+		ImageReaderType::Pointer fixedReader = ImageReaderType::New();
+		fixedReader->SetFileName(fixedImageFile);
+		fixedReader->Update();
+		// the fixed image is shared by all subject workers- detach it so no worker re-executes the reader
+		fixedFileImage = fixedReader->GetOutput();
+		fixedFileImage->DisconnectPipeline();
+	}
+	std::string settingsDigest = stateDirectory.empty() ? "" : SettingsDigest(fixedFileImage, settings, demons);
+	if (!stateDirectory.empty() && refinements < 1) {
+		std::cerr << "-state needs a deformable sum (refinements >= 1)" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (!stateDirectory.empty() && state.Read(stateDirectory)) {
+		bool changed = state.settings != settingsDigest;
+		if (changed) {
+			std::cout << "the fixed image or the registration settings changed since the atlas in " << stateDirectory << " was built" << std::endl;
+		}
+		if (options.GetInt("refresh", 0) || state.refresh || changed) {
+			// the rebuild keeps every subject of the atlas, also those added by updates with other ranges
+			std::vector < std::string > stored = AccumulatorType::ReadShardSubjects(state.GetFiles(stateDirectory) + "/deformableSum.nrrd");
+			for (size_t k = 0; k < stored.size(); ++k) {
+				int i = SubjectNumber(stored[k]);
+				if (std::find(subjects.begin(), subjects.end(), i) == subjects.end()) {
+					subjects.push_back(i);
+				}
+			}
+			std::sort(subjects.begin(), subjects.end());
+			std::cout << "rebuilding the atlas in " << stateDirectory << " from " << subjects.size() << " subjects (drift " << state.drift << ")" << std::endl;
+		} else {
+			return UpdateAtlas(stateDirectory, state, subjects, FixedSubject(fixedImageFile), settings, demons, store, jobs, refreshDrift) ? 0 : EXIT_FAILURE;
+		}
+	}
+
+	// read the cohort once
+	SubjectCacheType cache;
+	cache.SetCompact(options.GetInt("compactCache", 0));
+	bool ok = atlas::RunSubjects(subjects, jobs, [&](int i)
+	{
+		cache.Load(SubjectName(i), SubjectName(i) + "-MPRAGE.nii.gz");
+		return true;
+	});
+	if (!ok) {
+		return EXIT_FAILURE;
+	}
+	std::cout << "cached " << cache.GetNumberOfSubjects() << " subjects (" << cache.GetMemorySize() / (1024 * 1024) << " MB" << (cache.GetCompact() ? ", float" : "") << ")" << std::endl;
+
+	// initial template: mean of the unregistered subjects (as ./Setup i)
+	AccumulatorType iAccumulator ;
+	for (size_t k = 0; k < subjects.size(); ++k)
+	{
+		iAccumulator.Add(cache.Get(SubjectName(subjects[k])), SubjectName(subjects[k]));
+	}
+	ImageType::Pointer initialTemplate = Average(iAccumulator);
+	WriteImage(initialTemplate, "initialTemplate.nii.gz");
+
+	// affine stage: register every subject to the fixed image, keep only the transforms
+	ImageType::Pointer fixedImage = initialTemplate;
+	int ffn = FixedSubject(fixedImageFile);
+	if (fixedImageFile != "initial") {
+		fixedImage = fixedFileImage;
+	}
+	// pyramid and samples of the fixed image, computed once for all subjects (and kept in the store)
+	FixedImageCacheType fixedCache(fixedImage, store);
+	std::map < int, AffineTransformType::Pointer > transforms;
+	for (size_t k = 0; k < subjects.size(); ++k)
+	{
+		// filled in by the workers, the map itself doesn't change while they run (.at only looks up, operator[] may insert)
+		transforms[subjects[k]] = AffineTransformType::New();
+	}
+	AccumulatorType tAccumulator ;
+	ok = atlas::RunSubjects(subjects, jobs, [&](int i)
+	{
+		std::string is = SubjectName(i);
+		ImageType::ConstPointer moving = cache.Get(is);
+		if (i == ffn) {
+			// the fixed subject is already aligned with itself
+			transforms.at(i)->SetIdentity();
+		} else {
+			std::cout << "now registering " << is << std::endl;
+			AffineTransformType::Pointer transform = atlas::RegisterAffine(store, is, fixedImage.GetPointer(), moving.GetPointer(), settings, &fixedCache);
+			transforms.at(i)->SetFixedParameters(transform->GetFixedParameters());
+			transforms.at(i)->SetParameters(transform->GetParameters());
+		}
+		tAccumulator.Add(AffineRegistrationType::Resample(moving, transforms.at(i), fixedImage), is);
+		return true;
+	});
+	if (!ok) {
+		return EXIT_FAILURE;
+	}
+	ImageType::Pointer templateImage = Average(tAccumulator);
+	WriteImage(templateImage, "affineTemplate.nii.gz");
+
+	// deformable stage: register every affinely aligned subject to the current template and average,
+	// then repeat with the new template until it stops changing
+	// the sum of the last refinement and the template it registered to are kept for incremental updates (-state)
+	AccumulatorType lastAccumulator ;
+	ImageType::Pointer referenceTemplate;
+	for (unsigned int refinement = 1; refinement <= refinements; ++refinement)
+	{
+		AccumulatorType dAccumulator ;
+		// reference histogram of the template, computed once per refinement
+		FixedImageCacheType templateCache(templateImage);
+		ok = atlas::RunSubjects(subjects, jobs, [&](int i)
+		{
+			std::string is = SubjectName(i);
+			std::cout << "deformably registering " << is << " (refinement " << refinement << ")" << std::endl;
+			// the affine result is resampled on the fly from the cached subject
+			ImageType::Pointer affineResult = AffineRegistrationType::Resample(cache.Get(is), transforms.at(i), fixedImage);
+			// with a store each refinement starts from the subject's field of the previous one
+			dAccumulator.Add(atlas::RegisterDemons < ImageType, DisplacementFieldType >(store, is, templateImage, affineResult, demons, &templateCache), is);
+			return true;
+		});
+		if (!ok) {
+			return EXIT_FAILURE;
+		}
+		ImageType::Pointer newTemplate = Average(dAccumulator);
+		double change = RMSChange(templateImage, newTemplate);
+		referenceTemplate = templateImage;
+		lastAccumulator.Swap(dAccumulator);
+		templateImage = newTemplate;
+		std::stringstream r;
+		r << refinement;
+		WriteImage(templateImage, "deformableTemplate" + r.str() + ".nii.gz");
+		std::cout << "refinement " << refinement << ": RMS template change " << change << std::endl;
+		if (change < tolerance) {
+			std::cout << "converged (tolerance " << tolerance << ")" << std::endl;
+			break;
+		}
+	}
+	WriteImage(templateImage, "deformableAtlas.nii.gz");
+
+	if (!stateDirectory.empty()) {
+		// everything a later run needs to add subjects without the cohort
+		itksys::SystemTools::MakeDirectory(stateDirectory);
+		state.settings = settingsDigest;
+		state.drift = 0;
+		state.refresh = false;
+		SaveAtlas(stateDirectory, state, iAccumulator, tAccumulator, lastAccumulator, fixedImage, referenceTemplate, templateImage);
+	}
+	return 0;
+}
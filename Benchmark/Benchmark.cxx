@@ -0,0 +1,292 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstdlib>
+#include <cmath>
+#include <iomanip>
+#include <vector>
+#include "itkImage.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "AtlasAccumulator.h"
+#include "AtlasTypes.h"
+#include "AtlasOptions.h"
+#include "AtlasTrace.h"
+#include "SubjectWorkerPool.h"
+#include "AffineRegistration.h"
+#include "DemonsRegistration.h"
+
+// constants
+const unsigned int nDims = 3 ;
+const double fieldOfView = 256.0 ; // mm, the same for every size so the known transforms don't depend on it
+const double pi = 3.14159265358979323846 ;
+
+// set up types
+typedef itk::Image < atlas::PixelType, nDims > ImageType ;
+typedef itk::Image < atlas::SumPixelType, nDims > SumImageType ;
+typedef atlas::Accumulator < ImageType, SumImageType > AccumulatorType ;
+typedef itk::Vector < atlas::FieldComponentType, nDims > VectorPixelType ;
+typedef itk::Image < VectorPixelType, nDims > DisplacementFieldType ;
+typedef atlas::AffineRegistration < ImageType > AffineRegistrationType ;
+typedef AffineRegistrationType::SettingsType AffineSettings ;
+typedef AffineRegistrationType::AffineTransformType AffineTransformType ;
+typedef atlas::DemonsRegistration < ImageType, DisplacementFieldType > DemonsRegistrationType ;
+
+// inside of the ellipsoid with center c and radii r (mm)
+bool Inside(const ImageType::PointType & p, double cx, double cy, double cz, double rx, double ry, double rz)
+{
+	double x = (p[0] - cx) / rx;
+	double y = (p[1] - cy) / ry;
+	double z = (p[2] - cz) / rz;
+	return x * x + y * y + z * z <= 1;
+}
+
+// synthetic T1-like head of size^3 voxels over a fixed field of view:
+// scalp, CSF, folded (textured) brain and two ventricles
+ImageType::Pointer MakePhantom(unsigned int size)
+{
+	ImageType::Pointer phantom = ImageType::New();
+	ImageType::SizeType imageSize;
+	imageSize.Fill(size);
+	ImageType::RegionType region;
+	region.SetSize(imageSize);
+	phantom->SetRegions(region);
+	ImageType::SpacingType spacing;
+	spacing.Fill(fieldOfView / size);
+	phantom->SetSpacing(spacing);
+	ImageType::PointType origin;
+	origin.Fill(-fieldOfView / 2 + spacing[0] / 2);
+	phantom->SetOrigin(origin);
+	phantom->Allocate();
+
+	itk::ImageRegionIteratorWithIndex < ImageType > it(phantom, region);
+	for (; !it.IsAtEnd(); ++it)
+	{
+		ImageType::PointType p;
+		phantom->TransformIndexToPhysicalPoint(it.GetIndex(), p);
+		double value = 0;
+		if (Inside(p, 0, 0, 0, 90, 110, 80)) {
+			value = 100;
+		}
+		if (Inside(p, 0, 0, 0, 82, 102, 72)) {
+			value = 50;
+		}
+		if (Inside(p, 0, 0, 0, 78, 98, 68)) {
+			value = 150 + 30 * std::sin(p[0] / 6) * std::sin(p[1] / 7) * std::sin(p[2] / 5);
+		}
+		if (Inside(p, -12, 5, 5, 8, 25, 10) || Inside(p, 12, 5, 5, 8, 25, 10)) {
+			value = 40;
+		}
+		it.Set(static_cast < atlas::PixelType >(value));
+	}
+	return phantom;
+}
+
+// the known affine: moving(x) = fixed(T(x)), a few degrees of rotation, slight scaling, mm translation
+AffineTransformType::Pointer MakeAffine()
+{
+	AffineTransformType::Pointer transform = AffineTransformType::New();
+	transform->SetIdentity();
+	AffineTransformType::OutputVectorType scale;
+	scale[0] = 1.02;
+	scale[1] = 0.99;
+	scale[2] = 1.0;
+	transform->Scale(scale);
+	transform->Rotate(0, 1, 3 * pi / 180);
+	AffineTransformType::OutputVectorType translation;
+	translation[0] = 2;
+	translation[1] = -1;
+	translation[2] = 1;
+	transform->Translate(translation);
+	return transform;
+}
+
+// the known smooth deformation (mm) at p: moving(x) = fixed(x + D(x))
+VectorPixelType Deformation(const ImageType::PointType & p, double amplitude)
+{
+	VectorPixelType d;
+	d[0] = amplitude * std::sin(2 * pi * p[1] / fieldOfView) * std::cos(2 * pi * p[2] / fieldOfView);
+	d[1] = amplitude * std::sin(2 * pi * p[2] / fieldOfView) * std::cos(2 * pi * p[0] / fieldOfView);
+	d[2] = amplitude * std::sin(2 * pi * p[0] / fieldOfView) * std::cos(2 * pi * p[1] / fieldOfView);
+	return d;
+}
+
+DisplacementFieldType::Pointer MakeDeformation(const ImageType * reference, double amplitude)
+{
+	DisplacementFieldType::Pointer field = DisplacementFieldType::New();
+	field->CopyInformation(reference);
+	field->SetRegions(reference->GetLargestPossibleRegion());
+	field->Allocate();
+	itk::ImageRegionIteratorWithIndex < DisplacementFieldType > it(field, field->GetLargestPossibleRegion());
+	for (; !it.IsAtEnd(); ++it)
+	{
+		ImageType::PointType p;
+		field->TransformIndexToPhysicalPoint(it.GetIndex(), p);
+		it.Set(Deformation(p, amplitude));
+	}
+	return field;
+}
+
+// mean distance (mm) between x and T(R(x)) over the head- 0 when R is exactly the inverse of T
+double AffineError(const ImageType * phantom, const AffineTransformType * truth, const AffineTransformType * recovered)
+{
+	double sum = 0;
+	unsigned long count = 0;
+	itk::ImageRegionConstIteratorWithIndex < ImageType > it(phantom, phantom->GetLargestPossibleRegion());
+	for (; !it.IsAtEnd(); ++it)
+	{
+		if (it.Get() == 0) {
+			continue;
+		}
+		ImageType::PointType p;
+		phantom->TransformIndexToPhysicalPoint(it.GetIndex(), p);
+		sum += p.EuclideanDistanceTo(truth->TransformPoint(recovered->TransformPoint(p)));
+		++count;
+	}
+	return count > 0 ? sum / count : 0;
+}
+
+// mean |F(x) + D(x + F(x))| (mm) over the head- 0 when the Demons field F exactly undoes the deformation D
+double DeformationError(const ImageType * phantom, const DisplacementFieldType * field, double amplitude)
+{
+	double sum = 0;
+	unsigned long count = 0;
+	itk::ImageRegionConstIteratorWithIndex < ImageType > it(phantom, phantom->GetLargestPossibleRegion());
+	for (; !it.IsAtEnd(); ++it)
+	{
+		if (it.Get() == 0) {
+			continue;
+		}
+		ImageType::PointType p;
+		phantom->TransformIndexToPhysicalPoint(it.GetIndex(), p);
+		VectorPixelType f = field->GetPixel(it.GetIndex());
+		ImageType::PointType q;
+		for (unsigned int d = 0; d < nDims; ++d) {
+			q[d] = p[d] + f[d];
+		}
+		VectorPixelType residual = f + Deformation(q, amplitude);
+		sum += residual.GetNorm();
+		++count;
+	}
+	return count > 0 ? sum / count : 0;
+}
+
+// one result line
+struct Result
+{
+	unsigned int size ;
+	std::string stage ;
+	double seconds ;
+	double megavoxelsPerSecond ; // voxels processed (times iterations for the registrations) per second
+	double error ; // mm, -1 if not applicable
+};
+
+void Report(std::vector < Result > & results, unsigned int size, const std::string & stage, double seconds, double voxels, double error)
+{
+	Result result = { size, stage, seconds, seconds > 0 ? voxels / seconds / 1e6 : 0, error };
+	results.push_back(result);
+	std::cout << std::setw(5) << size << "^3 " << std::setw(12) << stage << std::setw(12) << std::fixed << std::setprecision(3) << seconds << " s"
+		<< std::setw(12) << result.megavoxelsPerSecond << " Mvox/s";
+	if (error >= 0) {
+		std::cout << std::setw(10) << error << " mm";
+	}
+	std::cout << std::endl;
+}
+
+int main(int argc, char * argv[])
+{
+	atlas::Options options;
+	if (!options.Parse(argc, argv, 1))
+	{
+		std::cout << "usage: ./Benchmark [options]" << std::endl;
+		std::cout << "times the affine registration, Demons, resampling, warping and accumulation on synthetic phantoms with a known affine transform and smooth deformation" << std::endl;
+		std::cout << "options: -sizes=list (phantom sizes in voxels per side, default 64,128) -amplitude=num (deformation in mm, default 3) -accumulate=num (images added, default 8) -csv=file -trace=file -threads=num" << std::endl;
+		std::cout << "affine and Demons options as for Registration and dRegistration (e.g. -iterations=list -steps=list -shrink=list -sampling=random -demonsIterations=num)" << std::endl;
+		std::cout << "example: ./Benchmark -sizes=128,256,512 -csv=benchmark.csv" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::vector < double > sizes = options.GetDoubleList("sizes");
+	if (sizes.empty()) {
+		sizes.push_back(64);
+		sizes.push_back(128);
+	}
+	double amplitude = options.GetDouble("amplitude", 3);
+	unsigned int accumulate = options.GetInt("accumulate", 8);
+	AffineSettings settings;
+	if (!atlas::ReadAffineSettings(options, settings)) {
+		return EXIT_FAILURE;
+	}
+	atlas::DemonsSettings demons;
+	atlas::ReadDemonsSettings(options, demons);
+	atlas::Trace::GetInstance().SetFileName(options.GetString("trace", ""));
+	atlas::SetNumberOfITKThreads(atlas::ITKThreadsPerJob(1, options.GetInt("threads", 0)));
+
+	std::vector < Result > results;
+	for (size_t k = 0; k < sizes.size(); ++k)
+	{
+		unsigned int size = static_cast < unsigned int >(sizes[k]);
+		double voxels = static_cast < double >(size) * size * size;
+		std::cout << "phantom " << size << "^3 (" << voxels * sizeof(atlas::PixelType) / (1024 * 1024) << " MB per image)" << std::endl;
+		ImageType::Pointer phantom = MakePhantom(size);
+		AffineTransformType::Pointer truth = MakeAffine();
+		ImageType::Pointer affineMoving = AffineRegistrationType::Resample(phantom, truth, phantom);
+		DisplacementFieldType::Pointer deformation = MakeDeformation(phantom, amplitude);
+		ImageType::Pointer deformedMoving = DemonsRegistrationType::Warp(phantom, deformation, phantom);
+		deformation = nullptr;
+
+		// affine registration of the affinely moved phantom back onto the phantom
+		double start = atlas::Trace::GetWallTime();
+		AffineRegistrationType affine(phantom, settings);
+		affine.SetSubject("phantom");
+		affine.Update(affineMoving);
+		double seconds = atlas::Trace::GetWallTime() - start;
+		// iterations actually run (early stops included)
+		Report(results, size, "affine", seconds, voxels * affine.GetIterations(), AffineError(phantom, truth, affine.GetTransform()));
+
+		// resampling alone
+		start = atlas::Trace::GetWallTime();
+		ImageType::Pointer resampled = AffineRegistrationType::Resample(affineMoving, affine.GetTransform(), phantom);
+		Report(results, size, "resample", atlas::Trace::GetWallTime() - start, voxels, -1);
+		resampled = nullptr;
+		affineMoving = nullptr;
+
+		// Demons registration of the deformed phantom back onto the phantom (histogram matching, Demons, warp)
+		start = atlas::Trace::GetWallTime();
+		DemonsRegistrationType deformable(phantom, demons);
+		deformable.Update(deformedMoving);
+		seconds = atlas::Trace::GetWallTime() - start;
+		// a compact field (-fieldShrink) is judged as the warp sees it, interpolated onto the phantom grid
+		DisplacementFieldType::Pointer recovered = deformable.GetDisplacementField();
+		if (recovered->GetLargestPossibleRegion() != phantom->GetLargestPossibleRegion()) {
+			recovered = DemonsRegistrationType::ExpandField(recovered, phantom);
+		}
+		Report(results, size, "demons", seconds, deformable.GetVoxelIterations(), DeformationError(phantom, recovered, amplitude));
+
+		// warping alone
+		start = atlas::Trace::GetWallTime();
+		ImageType::Pointer warped = DemonsRegistrationType::Warp(deformedMoving, deformable.GetDisplacementField(), phantom);
+		Report(results, size, "warp", atlas::Trace::GetWallTime() - start, voxels, -1);
+
+		// template accumulation
+		start = atlas::Trace::GetWallTime();
+		AccumulatorType accumulator;
+		for (unsigned int a = 0; a < accumulate; ++a) {
+			accumulator.Add(warped);
+		}
+		Report(results, size, "accumulate", atlas::Trace::GetWallTime() - start, voxels * accumulate, -1);
+	}
+
+	if (options.Has("csv")) {
+		std::ofstream csv(options.GetString("csv", "").c_str());
+		csv << "size,stage,seconds,mvox_per_s,error_mm" << std::endl;
+		for (size_t k = 0; k < results.size(); ++k) {
+			csv << results[k].size << "," << results[k].stage << "," << results[k].seconds << "," << results[k].megavoxelsPerSecond << ",";
+			if (results[k].error >= 0) {
+				csv << results[k].error;
+			}
+			csv << std::endl;
+		}
+		std::cout << "wrote " << options.GetString("csv", "") << std::endl;
+	}
+	return 0;
+}
@@ -0,0 +1,756 @@
+#ifndef AffineRegistration_h
+#define AffineRegistration_h
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "itkImage.h"
+#include "itkAffineTransform.h"
+#include "itkMultiResolutionImageRegistrationMethod.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkRegularStepGradientDescentOptimizer.h"
+#include "itkResampleImageFilter.h"
+#include "itkMeanSquaresImageToImageMetric.h"
+#include "itkCommand.h"
+#include "itkCenteredTransformInitializer.h"
+#include "AtlasOptions.h"
+#include "SmoothingPyramidImageFilter.h"
+#include "MetricSampler.h"
+#include "FixedImageCache.h"
+#include "ForegroundMask.h"
+#include "ResultStore.h"
+#include "AtlasTrace.h"
+#include "SubjectWorkerPool.h"
+
+namespace atlas
+{
+
+// affine registration settings from the command line
+// per level lists are coarsest level first; a shorter list repeats its last value
+template < typename TImage >
+struct AffineSettings
+{
+	AffineSettings() : observer(false), levels(1), resample(false), mask(false), maskPadding(10), scales("none"),
+		initialize("none"), minimumStep(0), gradientTolerance(1e-4), plateauIterations(0), plateauTolerance(0.001) {}
+	bool observer ;
+	unsigned int levels ;
+	std::vector < double > shrinkFactors ; // empty --> ITK default schedule (2^(levels-1) ... 1)
+	std::vector < double > sigmas ; // empty --> ITK default smoothing (shrinkFactor / 2)
+	std::vector < double > iterations ;
+	std::vector < double > steps ; // maximum step length
+	MetricSampler < TImage > sampler ; // voxels the metric is evaluated at (default every voxel)
+	bool resample ; // draw new voxels every optimizer iteration instead of once per level
+	bool mask ; // metric only over the foreground of the fixed image, images cropped to its padded bounding box
+	double maskPadding ; // mm added around the foreground box
+	std::string scales ; // none or physical (parameters scaled by how far they move the fixed region, steps in mm)
+	std::string initialize ; // none, geometry or moments (centre the transform, match the image centres / centres of mass)
+	double minimumStep ; // a level stops once the step length was halved below this (0 --> off)
+	double gradientTolerance ; // a level stops once the (scaled) gradient magnitude is below this
+	unsigned int plateauIterations ; // a level stops once the metric improved by less than plateauTolerance
+	double plateauTolerance ; // (relative) over the last plateauIterations iterations (0 --> off)
+};
+
+// fill settings from the pyramid and sampling options (see README); returns false on a bad combination
+template < typename TImage >
+bool ReadAffineSettings(const Options & options, AffineSettings < TImage > & settings)
+{
+	settings.shrinkFactors = options.GetDoubleList("shrink");
+	settings.sigmas = options.GetDoubleList("sigmas");
+	settings.iterations = options.GetDoubleList("iterations");
+	settings.steps = options.GetDoubleList("steps");
+	settings.levels = options.GetInt("levels", settings.shrinkFactors.empty() ? 1 : static_cast < int >(settings.shrinkFactors.size()));
+	settings.sampler.SetMode(options.GetString("sampling", "full"));
+	settings.sampler.SetNumberOfSamples(options.GetInt("samples", 0));
+	settings.sampler.SetFraction(options.GetDouble("samplePercent", 0) / 100.0);
+	settings.sampler.SetSeed(options.GetInt("seed", 0));
+	settings.resample = options.GetInt("resample", 0);
+	settings.mask = options.GetInt("mask", 0);
+	settings.maskPadding = options.GetDouble("maskPadding", settings.maskPadding);
+	settings.scales = options.GetString("scales", settings.scales);
+	settings.initialize = options.GetString("initialize", settings.initialize);
+	settings.minimumStep = options.GetDouble("minimumStep", settings.minimumStep);
+	settings.gradientTolerance = options.GetDouble("gradientTolerance", settings.gradientTolerance);
+	settings.plateauIterations = options.GetInt("plateau", settings.plateauIterations);
+	settings.plateauTolerance = options.GetDouble("plateauTolerance", settings.plateauTolerance);
+	if (settings.scales != "none" && settings.scales != "physical") {
+		std::cerr << "unknown scales " << settings.scales << std::endl;
+		return false;
+	}
+	if (settings.initialize != "none" && settings.initialize != "geometry" && settings.initialize != "moments") {
+		std::cerr << "unknown initialize " << settings.initialize << std::endl;
+		return false;
+	}
+	if (settings.sampler.IsSampling() && settings.sampler.GetMode() != "random" && settings.sampler.GetMode() != "grid") {
+		std::cerr << "unknown sampling " << settings.sampler.GetMode() << std::endl;
+		return false;
+	}
+	if (settings.sampler.IsSampling() && !options.Has("samples") && !options.Has("samplePercent")) {
+		// default to 5% of the voxels
+		settings.sampler.SetFraction(0.05);
+	}
+	if (settings.iterations.empty()) {
+		settings.iterations.push_back(100);
+	}
+	if (settings.steps.empty()) {
+		// with physical scales a step is a distance: at most 1 mm per iteration
+		settings.steps.push_back(settings.scales == "physical" ? 1.0 : 0.0125);
+	}
+	if (settings.levels < 1 || (!settings.shrinkFactors.empty() && settings.shrinkFactors.size() != settings.levels)) {
+		std::cerr << "need one shrink factor per level (" << settings.levels << " levels)" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// the settings that change the registration result (not the observer)
+template < typename TImage >
+void HashAffineSettings(Hash & hash, const AffineSettings < TImage > & settings)
+{
+	hash.Add("affine");
+	hash.Add(static_cast < double >(settings.levels));
+	const std::vector < double > * lists[] = { &settings.shrinkFactors, &settings.sigmas, &settings.iterations, &settings.steps };
+	for (unsigned int k = 0; k < 4; ++k)
+	{
+		hash.Add(static_cast < double >(lists[k]->size()));
+		for (size_t l = 0; l < lists[k]->size(); ++l)
+		{
+			hash.Add((*lists[k])[l]);
+		}
+	}
+	hash.Add(settings.sampler.GetDescription());
+	hash.Add(static_cast < double >(settings.resample));
+	// only hashed when used, so results stored before masking existed are still found
+	if (settings.mask) {
+		hash.Add("mask");
+		hash.Add(settings.maskPadding);
+	}
+	if (settings.scales != "none") {
+		hash.Add("scales " + settings.scales);
+	}
+	if (settings.initialize != "none") {
+		hash.Add("initialize " + settings.initialize);
+	}
+	if (settings.minimumStep > 0) {
+		hash.Add("minimumStep");
+		hash.Add(settings.minimumStep);
+	}
+	if (settings.gradientTolerance != 1e-4) {
+		hash.Add("gradientTolerance");
+		hash.Add(settings.gradientTolerance);
+	}
+	if (settings.plateauIterations > 0 && settings.plateauTolerance > 0) {
+		hash.Add("plateau");
+		hash.Add(static_cast < double >(settings.plateauIterations));
+		hash.Add(settings.plateauTolerance);
+	}
+}
+
+// callback for optimizer like in class
+// prints the iterations (observer) and/or records them in the trace (-trace)
+class OptimizerIterationCallback : public itk::Command
+{
+public:
+	typedef OptimizerIterationCallback Self ;
+	typedef itk::Command Superclass ;
+	typedef itk::SmartPointer<OptimizerIterationCallback> Pointer ;
+	itkNewMacro(OptimizerIterationCallback);
+
+	typedef itk::RegularStepGradientDescentOptimizer OptimizerType ;
+	typedef const OptimizerType * OptimizerPointerType ;
+	// subject name printed with each iteration (several subjects may be registering at once)
+	void SetSubject(const std::string & subject)
+	{
+		m_Subject = subject ;
+	}
+	void SetPrint(bool print)
+	{
+		m_Print = print ;
+	}
+	// non-const if want to change
+	void Execute(itk::Object * caller, const itk::EventObject & event)
+	{
+		Execute((const itk::Object *) caller, event) ;
+	}
+	// const if just observing
+	void Execute(const itk::Object * caller, const itk::EventObject & event)
+	{
+		OptimizerPointerType optimizer = dynamic_cast < OptimizerPointerType > ( caller ) ;
+		if (m_Print)
+		{
+			std::cout << m_Subject << " iteration: " << optimizer->GetCurrentIteration() << " value: " << optimizer->GetValue() << std::endl;
+		}
+		if (Trace::GetInstance().IsEnabled())
+		{
+			double now = Trace::GetWallTime();
+			Trace::GetInstance().AddIteration("affine", m_Subject, optimizer->GetCurrentIteration(), optimizer->GetValue(), m_Last > 0 ? now - m_Last : 0);
+			m_Last = now;
+		}
+	}
+
+protected:
+	OptimizerIterationCallback() : m_Print(true), m_Last(0) {}
+
+private:
+	std::string m_Subject ;
+	bool m_Print ;
+	double m_Last ;
+};
+
+// stops the optimizer of a level once the metric stops improving: when the metric improved by less than tolerance
+// (relative) over the last window iterations (-plateau), and counts the iterations run (levels and early stops included)
+class OptimizerConvergenceCommand : public itk::Command
+{
+public:
+	typedef OptimizerConvergenceCommand Self ;
+	typedef itk::Command Superclass ;
+	typedef itk::SmartPointer<OptimizerConvergenceCommand> Pointer ;
+	itkNewMacro(OptimizerConvergenceCommand);
+
+	typedef itk::RegularStepGradientDescentOptimizer OptimizerType ;
+
+	void SetSubject(const std::string & subject)
+	{
+		m_Subject = subject ;
+	}
+	// window 0 --> never stop
+	void SetPlateau(unsigned int window, double tolerance)
+	{
+		m_Window = window ;
+		m_Tolerance = tolerance ;
+	}
+	unsigned int GetIterations() const
+	{
+		return m_Iterations ;
+	}
+
+	void Execute(itk::Object * caller, const itk::EventObject & event)
+	{
+		OptimizerType * optimizer = static_cast < OptimizerType * >(caller);
+		++m_Iterations;
+		if (optimizer->GetCurrentIteration() == 0) {
+			// new level
+			m_Values.clear();
+		}
+		m_Values.push_back(optimizer->GetValue());
+		if (m_Window == 0 || m_Tolerance <= 0 || m_Values.size() <= m_Window) {
+			return;
+		}
+		// mean squares, lower is better
+		double before = m_Values.front();
+		m_Values.pop_front();
+		if (before - m_Values.back() <= m_Tolerance * std::abs(before)) {
+			std::cout << m_Subject << (m_Subject.empty() ? "" : " ") << "metric plateau at iteration " << optimizer->GetCurrentIteration()
+				<< " (" << before << " --> " << m_Values.back() << "), stopping level" << std::endl;
+			optimizer->StopOptimization();
+		}
+	}
+
+	void Execute(const itk::Object *, const itk::EventObject &)
+	{
+		// a const caller can't be stopped
+	}
+
+protected:
+	OptimizerConvergenceCommand() : m_Window(0), m_Tolerance(0), m_Iterations(0) {}
+
+private:
+	std::string m_Subject ;
+	unsigned int m_Window ;
+	double m_Tolerance ;
+	unsigned int m_Iterations ;
+	std::deque < double > m_Values ;
+};
+
+// called at the start of every pyramid level to switch the optimizer to that level's iterations and step length
+// and to draw the metric samples for the level's grid
+template < typename TImage >
+class RegistrationInterfaceCommand : public itk::Command
+{
+public:
+	typedef RegistrationInterfaceCommand Self ;
+	typedef itk::Command Superclass ;
+	typedef itk::SmartPointer<RegistrationInterfaceCommand> Pointer ;
+	itkNewMacro(RegistrationInterfaceCommand);
+
+	typedef itk::MultiResolutionImageRegistrationMethod < TImage, TImage > RegistrationMethodType ;
+	typedef itk::RegularStepGradientDescentOptimizer OptimizerType ;
+	typedef itk::MeanSquaresImageToImageMetric < TImage, TImage > MetricType ;
+	typedef SmoothingPyramidImageFilter < TImage, TImage > PyramidType ;
+	typedef ForegroundMask < TImage > ForegroundMaskType ;
+	typedef typename ForegroundMaskType::MaskSpatialObjectType MaskSpatialObjectType ;
+
+	void SetOptimizer(OptimizerType * optimizer)
+	{
+		m_Optimizer = optimizer ;
+	}
+	void SetMetric(MetricType * metric)
+	{
+		m_Metric = metric ;
+	}
+	void SetFixedPyramid(PyramidType * pyramid)
+	{
+		m_FixedPyramid = pyramid ;
+	}
+	void SetSettings(const AffineSettings < TImage > * settings)
+	{
+		m_Settings = settings ;
+	}
+	// samples are taken from (and kept in) cache when set
+	void SetFixedImageCache(FixedImageCache < TImage > * cache)
+	{
+		m_Cache = cache ;
+	}
+	// samples are drawn inside box (a region of the full fixed image) and kept only inside mask (-mask)
+	void SetFixedForeground(const typename TImage::RegionType & box, const MaskSpatialObjectType * mask)
+	{
+		m_Box = box ;
+		m_Mask = mask ;
+	}
+
+	void Execute(itk::Object * caller, const itk::EventObject & event)
+	{
+		Execute((const itk::Object *) caller, event) ;
+	}
+	void Execute(const itk::Object * caller, const itk::EventObject & event)
+	{
+		if (!(itk::IterationEvent().CheckEvent(&event)))
+		{
+			return;
+		}
+		const RegistrationMethodType * registration = static_cast < const RegistrationMethodType * > ( caller ) ;
+		unsigned int level = registration->GetCurrentLevel();
+		m_Optimizer->SetNumberOfIterations(static_cast < unsigned int >(AtLevel(m_Settings->iterations, level)));
+		m_Optimizer->SetMaximumStepLength(AtLevel(m_Settings->steps, level));
+		if (m_Settings->sampler.IsSampling())
+		{
+			// the pyramid is already computed when the level starts; the metric picks the indexes up in Initialize()
+			const TImage * levelImage = m_FixedPyramid->GetOutput(level);
+			typename TImage::RegionType region = levelImage->GetLargestPossibleRegion();
+			if (m_Mask) {
+				region = ForegroundMaskType::MapRegion(registration->GetFixedImage(), m_Box, levelImage);
+			}
+			typename MetricSampler < TImage >::IndexListType indexes;
+			if (m_Cache) {
+				indexes = m_Cache->GetSamples(m_Settings->sampler, region, level);
+			} else {
+				indexes = m_Settings->sampler.Sample(region, level);
+			}
+			if (m_Mask) {
+				ForegroundMaskType::KeepInside(m_Mask, levelImage, indexes);
+			}
+			m_Metric->SetFixedImageIndexes(indexes);
+		}
+		if (m_Settings->levels > 1)
+		{
+			std::cout << "level " << level << ": " << m_Optimizer->GetNumberOfIterations() << " iterations, step " << m_Optimizer->GetMaximumStepLength() << std::endl;
+		}
+	}
+
+protected:
+	RegistrationInterfaceCommand() : m_Optimizer(nullptr), m_Metric(nullptr), m_FixedPyramid(nullptr), m_Settings(nullptr), m_Cache(nullptr), m_Mask(nullptr) {}
+
+private:
+	OptimizerType * m_Optimizer ;
+	MetricType * m_Metric ;
+	PyramidType * m_FixedPyramid ;
+	const AffineSettings < TImage > * m_Settings ;
+	FixedImageCache < TImage > * m_Cache ;
+	typename TImage::RegionType m_Box ;
+	const MaskSpatialObjectType * m_Mask ;
+};
+
+// draws a new set of metric samples after every optimizer iteration (-resample=1)
+template < typename TImage >
+class SampleRefreshCommand : public itk::Command
+{
+public:
+	typedef SampleRefreshCommand Self ;
+	typedef itk::Command Superclass ;
+	typedef itk::SmartPointer<SampleRefreshCommand> Pointer ;
+	itkNewMacro(SampleRefreshCommand);
+
+	typedef itk::MeanSquaresImageToImageMetric < TImage, TImage > MetricType ;
+	typedef MetricSampler < TImage > SamplerType ;
+	typedef ForegroundMask < TImage > ForegroundMaskType ;
+	typedef typename ForegroundMaskType::MaskSpatialObjectType MaskSpatialObjectType ;
+
+	void SetMetric(MetricType * metric)
+	{
+		m_Metric = metric ;
+	}
+	void SetSampler(const SamplerType * sampler)
+	{
+		m_Sampler = sampler ;
+	}
+	// new samples are kept only inside mask (-mask), as the level command keeps the first ones
+	void SetFixedForeground(const MaskSpatialObjectType * mask)
+	{
+		m_Mask = mask ;
+	}
+
+	void Execute(const itk::Object * caller, const itk::EventObject & event)
+	{
+		Execute(const_cast < itk::Object * >(caller), event) ;
+	}
+	void Execute(itk::Object * caller, const itk::EventObject & event)
+	{
+		// draw numbers start after the per level draws so no set is reused
+		++m_Draws;
+		typename SamplerType::IndexListType indexes = m_Sampler->Sample(m_Metric->GetFixedImageRegion(), 1000 + m_Draws);
+		if (m_Mask) {
+			ForegroundMaskType::KeepInside(m_Mask, m_Metric->GetFixedImage(), indexes);
+		}
+		m_Metric->SetFixedImageIndexes(indexes);
+		m_Metric->MultiThreadingInitialize();
+	}
+
+protected:
+	SampleRefreshCommand() : m_Metric(nullptr), m_Sampler(nullptr), m_Mask(nullptr), m_Draws(0) {}
+
+private:
+	MetricType * m_Metric ;
+	const SamplerType * m_Sampler ;
+	const MaskSpatialObjectType * m_Mask ;
+	unsigned int m_Draws ;
+};
+
+// affine registration of one moving image to a fixed image (multi-resolution, mean squares,
+// regular step gradient descent), then resampling of the moving image onto the fixed grid
+// shared by Registration and the Atlas driver
+template < typename TImage >
+class AffineRegistration
+{
+public:
+	typedef TImage ImageType ;
+	typedef typename ImageType::Pointer ImagePointer ;
+	static const unsigned int ImageDimension = ImageType::ImageDimension ;
+	typedef AffineSettings < ImageType > SettingsType ;
+	typedef itk::MultiResolutionImageRegistrationMethod < ImageType, ImageType > RegistrationMethodType ;
+	typedef itk::AffineTransform < double, ImageDimension > AffineTransformType ;
+	typedef itk::RegularStepGradientDescentOptimizer OptimizerType ;
+	typedef itk::LinearInterpolateImageFunction < ImageType > InterpolatorType ;
+	typedef itk::ResampleImageFilter < ImageType, ImageType > ResampleFilterType ;
+	typedef itk::MeanSquaresImageToImageMetric <ImageType, ImageType > MetricType ;
+	typedef SmoothingPyramidImageFilter < ImageType, ImageType > PyramidType ;
+	typedef RegistrationInterfaceCommand < ImageType > LevelCommandType ;
+	typedef SampleRefreshCommand < ImageType > RefreshCommandType ;
+	typedef FixedImageCache < ImageType > FixedImageCacheType ;
+	typedef ForegroundMask < ImageType > ForegroundMaskType ;
+	typedef itk::CenteredTransformInitializer < AffineTransformType, ImageType, ImageType > InitializerType ;
+
+	AffineRegistration(const ImageType * fixedImage, const SettingsType & settings)
+		: m_FixedImage(fixedImage), m_Settings(settings), m_WarmStart(false), m_Cache(nullptr), m_Iterations(0) {}
+
+	// name printed by the iteration observer
+	void SetSubject(const std::string & subject)
+	{
+		m_Subject = subject ;
+	}
+
+	// take the fixed image pyramid and samples from cache (built once for all subjects) instead of computing them
+	// cache must be of the fixed image; throws itk::ExceptionObject otherwise
+	void SetFixedImageCache(FixedImageCacheType * cache)
+	{
+		if (cache && cache->GetFixedImage() != m_FixedImage) {
+			itkGenericExceptionMacro(<< "fixed image cache of another image");
+		}
+		m_Cache = cache ;
+	}
+
+	// start the optimizer from transform (e.g. the subject's result of an earlier run) instead of the identity
+	void SetInitialTransform(const AffineTransformType * transform)
+	{
+		m_InitialFixedParameters = transform->GetFixedParameters();
+		m_InitialParameters = transform->GetParameters();
+		m_WarmStart = true;
+	}
+
+	// register moving to the fixed image; throws itk::ExceptionObject if the registration fails
+	void Update(const ImageType * moving)
+	{
+		// the filters run on grafts: the fixed image is shared with the other subject workers (see GraftImage)
+		ImagePointer fixedGraft = GraftImage(m_FixedImage);
+		ImagePointer movingGraft = GraftImage(moving);
+		const ImageType * fixedImage = fixedGraft.GetPointer();
+		const ImageType * movingImage = movingGraft.GetPointer();
+		// gather registration materials
+		typename RegistrationMethodType::Pointer registration = RegistrationMethodType::New();
+		m_Transform = AffineTransformType::New();
+		typename MetricType::Pointer metric = MetricType::New() ;
+		OptimizerType::Pointer optimizer = OptimizerType::New();
+		typename InterpolatorType::Pointer interpolator = InterpolatorType::New() ;
+
+		// foreground (-mask): the metric only counts fixed voxels of the head, the fixed region is its padded box
+		// and the moving image is cropped to its own padded box, so the pyramids and every iteration see far
+		// fewer voxels; the transform is physical and applies to the full images
+		typename ImageType::RegionType fixedRegion = fixedImage->GetLargestPossibleRegion();
+		typename ForegroundMaskType::MaskSpatialObjectPointer fixedMask;
+		ImagePointer croppedMoving;
+		if (m_Settings.mask) {
+			if (m_Cache) {
+				fixedMask = m_Cache->GetForegroundSpatialObject();
+				fixedRegion = m_Cache->GetForegroundBox(m_Settings.maskPadding);
+			} else {
+				typename ForegroundMaskType::MaskImagePointer mask = ForegroundMaskType::GetMask(fixedImage);
+				fixedMask = ForegroundMaskType::GetMaskSpatialObject(mask);
+				fixedRegion = ForegroundMaskType::GetBoundingBox(mask, m_Settings.maskPadding);
+			}
+			metric->SetFixedImageMask(fixedMask);
+			typename ImageType::RegionType movingBox = ForegroundMaskType::GetBoundingBox(ForegroundMaskType::GetMask(movingImage), m_Settings.maskPadding);
+			croppedMoving = ForegroundMaskType::Crop(movingImage, movingBox);
+		}
+
+		// set up affine registration
+		registration->SetFixedImage(fixedImage) ;
+		registration->SetMovingImage(croppedMoving.IsNotNull() ? croppedMoving.GetPointer() : movingImage);
+		registration->SetOptimizer ( optimizer ) ;
+		registration->SetMetric ( metric ) ;
+		registration->SetInterpolator ( interpolator ) ;
+		registration->SetTransform( m_Transform ) ;
+		optimizer->MinimizeOn() ;
+		optimizer->SetNumberOfIterations ( AtLevel(m_Settings.iterations, 0) ) ;
+		optimizer->SetMinimumStepLength( m_Settings.minimumStep ) ;
+		optimizer->SetMaximumStepLength( AtLevel(m_Settings.steps, 0) ) ;
+		optimizer->SetGradientMagnitudeTolerance( m_Settings.gradientTolerance ) ;
+		m_Transform->SetIdentity() ;
+		if (m_WarmStart) {
+			m_Transform->SetFixedParameters( m_InitialFixedParameters ) ;
+			m_Transform->SetParameters( m_InitialParameters ) ;
+		} else if (m_Settings.initialize != "none") {
+			// centre of rotation at the fixed image centre (of mass), translation to the moving one
+			TraceStage stage("initialize", m_Subject);
+			typename InitializerType::Pointer initializer = InitializerType::New();
+			initializer->SetTransform(m_Transform);
+			initializer->SetFixedImage(fixedImage);
+			initializer->SetMovingImage(croppedMoving.IsNotNull() ? croppedMoving.GetPointer() : movingImage);
+			if (m_Settings.initialize == "moments") {
+				initializer->MomentsOn();
+			} else {
+				initializer->GeometryOn();
+			}
+			initializer->InitializeTransform();
+		} else if (m_Settings.scales == "physical") {
+			// the identity, rotating about the centre of the fixed region instead of the origin
+			m_Transform->SetCenter(GetRegionCenter(fixedImage, fixedRegion));
+		}
+		if (m_Settings.scales == "physical") {
+			optimizer->SetScales(GetPhysicalScales(m_Transform, fixedImage, fixedRegion));
+		}
+		registration->SetInitialTransformParameters( m_Transform->GetParameters() ) ;
+		registration->SetFixedImageRegion ( fixedRegion ) ;
+
+		// coarse to fine schedule- most iterations run on the shrunk levels
+		typename PyramidType::Pointer fixedPyramid = PyramidType::New();
+		typename PyramidType::Pointer movingPyramid = PyramidType::New();
+		fixedPyramid->SetSmoothingSigmas(m_Settings.sigmas);
+		movingPyramid->SetSmoothingSigmas(m_Settings.sigmas);
+		if (m_Cache) {
+			fixedPyramid->SetPrecomputedLevels(m_Cache->GetPyramidLevels(m_Settings.levels, m_Settings.shrinkFactors, m_Settings.sigmas));
+		}
+		registration->SetFixedImagePyramid(fixedPyramid);
+		registration->SetMovingImagePyramid(movingPyramid);
+		if (m_Settings.shrinkFactors.empty()) {
+			registration->SetNumberOfLevels(m_Settings.levels);
+		} else {
+			typename RegistrationMethodType::ScheduleType schedule(m_Settings.levels, ImageDimension);
+			for (unsigned int level = 0; level < m_Settings.levels; ++level) {
+				for (unsigned int d = 0; d < ImageDimension; ++d) {
+					schedule[level][d] = static_cast < unsigned int >(m_Settings.shrinkFactors[level]);
+				}
+			}
+			registration->SetSchedules(schedule, schedule);
+		}
+		typename LevelCommandType::Pointer levelCommand = LevelCommandType::New();
+		levelCommand->SetOptimizer(optimizer);
+		levelCommand->SetMetric(metric);
+		levelCommand->SetFixedPyramid(fixedPyramid);
+		levelCommand->SetSettings(&m_Settings);
+		levelCommand->SetFixedImageCache(m_Cache);
+		if (fixedMask.IsNotNull()) {
+			levelCommand->SetFixedForeground(fixedRegion, fixedMask);
+		}
+		registration->AddObserver(itk::IterationEvent(), levelCommand);
+		OptimizerConvergenceCommand::Pointer convergence = OptimizerConvergenceCommand::New();
+		convergence->SetSubject(m_Subject);
+		convergence->SetPlateau(m_Settings.plateauIterations, m_Settings.plateauTolerance);
+		optimizer->AddObserver(itk::IterationEvent(), convergence);
+		if (m_Settings.sampler.IsSampling() && m_Settings.resample) {
+			typename RefreshCommandType::Pointer refreshCommand = RefreshCommandType::New();
+			refreshCommand->SetMetric(metric);
+			refreshCommand->SetSampler(&m_Settings.sampler);
+			if (fixedMask.IsNotNull()) {
+				refreshCommand->SetFixedForeground(fixedMask);
+			}
+			optimizer->AddObserver(itk::IterationEvent(), refreshCommand);
+		}
+
+		// add callbacks based on observer flag
+		if (m_Settings.observer || Trace::GetInstance().IsEnabled()) {
+			OptimizerIterationCallback::Pointer optCallback = OptimizerIterationCallback::New();
+			optCallback->SetSubject(m_Subject);
+			optCallback->SetPrint(m_Settings.observer);
+			optimizer->AddObserver(itk::IterationEvent(), optCallback);
+		}
+
+		{
+			TraceStage stage("affine", m_Subject);
+			registration->Update();
+		}
+		std::cout << m_Subject << " stopped because " << optimizer->GetStopConditionDescription() << std::endl;
+		m_Iterations = convergence->GetIterations();
+
+		m_Output = Resample(movingImage, m_Transform, fixedImage, m_Subject);
+	}
+
+	// moving image resampled onto the reference grid with transform
+	static ImagePointer Resample(const ImageType * movingImage, const AffineTransformType * transform, const ImageType * reference,
+		const std::string & subject = "")
+	{
+		TraceStage stage("resample", subject);
+		typename ResampleFilterType::Pointer resampleFilter = GetResampler(movingImage, transform, reference);
+		resampleFilter->Update() ;
+		ImagePointer output = resampleFilter->GetOutput();
+		output->DisconnectPipeline();
+		return output;
+	}
+
+	// the resampler of Resample, not yet updated- e.g. to pull the result through slab by slab
+	// (the whole moving image is needed, the reference only for its grid)
+	static typename ResampleFilterType::Pointer GetResampler(const ImageType * movingImage, const AffineTransformType * transform,
+		const ImageType * reference)
+	{
+		typename ResampleFilterType::Pointer resampleFilter = ResampleFilterType::New() ;
+		// grafts: the reference is usually the fixed image every subject worker resamples onto
+		resampleFilter->SetInput ( GraftImage(movingImage) ) ;
+		resampleFilter->SetTransform ( transform ) ;
+		resampleFilter->SetReferenceImage( GraftImage(reference) ) ;
+		resampleFilter->UseReferenceImageOn() ;
+		return resampleFilter;
+	}
+
+	// the moving image resampled onto the fixed grid
+	ImageType * GetOutput() const
+	{
+		return m_Output.GetPointer();
+	}
+
+	AffineTransformType * GetTransform() const
+	{
+		return m_Transform.GetPointer();
+	}
+
+	// optimizer iterations run, over all levels (less than the settings ask for after early stops)
+	unsigned int GetIterations() const
+	{
+		return m_Iterations;
+	}
+
+	// physical centre of region of image
+	static typename AffineTransformType::InputPointType GetRegionCenter(const ImageType * image, const typename ImageType::RegionType & region)
+	{
+		itk::ContinuousIndex < double, ImageDimension > center;
+		for (unsigned int d = 0; d < ImageDimension; ++d) {
+			center[d] = region.GetIndex(d) + (region.GetSize(d) - 1) / 2.0;
+		}
+		typename AffineTransformType::InputPointType point;
+		image->TransformContinuousIndexToPhysicalPoint(center, point);
+		return point;
+	}
+
+	// optimizer scales from physical shifts: a unit change of matrix element (i, j) moves a point x by x_j - c_j (c the
+	// centre of rotation) along i, at most shift_j mm over region, a translation by 1 mm- scaling element (i, j) by
+	// shift_j^2 makes every step move the region by about the step length in mm, whatever the parameter
+	static OptimizerType::ScalesType GetPhysicalScales(const AffineTransformType * transform, const ImageType * image, const typename ImageType::RegionType & region)
+	{
+		const typename AffineTransformType::InputPointType & center = transform->GetCenter();
+		std::vector < double > shift(ImageDimension, 0);
+		// the largest shifts are at the corners
+		for (unsigned int corner = 0; corner < (1u << ImageDimension); ++corner) {
+			typename ImageType::IndexType index = region.GetIndex();
+			for (unsigned int d = 0; d < ImageDimension; ++d) {
+				if (corner & (1u << d)) {
+					index[d] += region.GetSize(d) - 1;
+				}
+			}
+			typename ImageType::PointType point;
+			image->TransformIndexToPhysicalPoint(index, point);
+			for (unsigned int d = 0; d < ImageDimension; ++d) {
+				shift[d] = std::max(shift[d], std::abs(point[d] - center[d]));
+			}
+		}
+		OptimizerType::ScalesType scales(transform->GetNumberOfParameters());
+		scales.Fill(1.0);
+		for (unsigned int i = 0; i < ImageDimension; ++i) {
+			for (unsigned int j = 0; j < ImageDimension; ++j) {
+				scales[i * ImageDimension + j] = std::max(shift[j] * shift[j], 1.0);
+			}
+		}
+		return scales;
+	}
+
+private:
+	const ImageType * m_FixedImage ;
+	const SettingsType & m_Settings ;
+	std::string m_Subject ;
+	bool m_WarmStart ;
+	FixedImageCacheType * m_Cache ;
+	typename AffineTransformType::ParametersType m_InitialParameters ;
+	typename AffineTransformType::FixedParametersType m_InitialFixedParameters ;
+	typename AffineTransformType::Pointer m_Transform ;
+	ImagePointer m_Output ;
+	unsigned int m_Iterations ;
+};
+
+// affine transform of subject through the result store: the stored transform if the fixed image, the moving image
+// and the settings are unchanged since it was stored, otherwise a new registration (warm-started from the subject's
+// last stored transform, if any) whose result is stored
+// with the store disabled this is just AffineRegistration
+// cache (optional) holds what is computed from the fixed image alone, shared by the subjects
+template < typename TImage >
+typename AffineRegistration < TImage >::AffineTransformType::Pointer
+RegisterAffine(const ResultStore & store, const std::string & subject, const TImage * fixedImage, const TImage * movingImage,
+	const AffineSettings < TImage > & settings, FixedImageCache < TImage > * cache = nullptr)
+{
+	typedef AffineRegistration < TImage > RegistrationType ;
+	typedef typename RegistrationType::AffineTransformType AffineTransformType ;
+	typename AffineTransformType::Pointer transform = AffineTransformType::New();
+	std::string key;
+	if (store.IsEnabled())
+	{
+		// the fixed image is hashed once per run by the cache, only the moving image for every subject
+		Hash hash;
+		hash.Add(GetFixedImageDigest(fixedImage, cache));
+		hash.AddImage(movingImage);
+		HashAffineSettings(hash, settings);
+		key = hash.GetDigest();
+		if (store.Has(subject, "affine", key, "tfm"))
+		{
+			store.ReadTransform(subject, "affine", key, transform.GetPointer());
+			std::cout << subject << " unchanged, reusing " << store.GetPath(subject, "affine", key, "tfm") << std::endl;
+			return transform;
+		}
+	}
+	RegistrationType registration(fixedImage, settings);
+	registration.SetSubject(subject);
+	registration.SetFixedImageCache(cache);
+	std::string previous = store.GetLatestKey(subject, "affine");
+	if (!previous.empty() && store.Has(subject, "affine", previous, "tfm"))
+	{
+		store.ReadTransform(subject, "affine", previous, transform.GetPointer());
+		registration.SetInitialTransform(transform);
+		std::cout << subject << " warm start from " << store.GetPath(subject, "affine", previous, "tfm") << std::endl;
+	}
+	registration.Update(movingImage);
+	if (store.IsEnabled())
+	{
+		store.WriteTransform(subject, "affine", key, registration.GetTransform());
+	}
+	return registration.GetTransform();
+}
+
+} // end namespace atlas
+
+#endif
@@ -0,0 +1,451 @@
+#ifndef AtlasAccumulator_h
+#define AtlasAccumulator_h
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <mutex>
+#include <utility>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "itkImage.h"
+#include "itkImageRegionIterator.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkImageIORegion.h"
+#include "itkImageRegionSplitterSlowDimension.h"
+#include "itkCastImageFilter.h"
+#include "itkDivideImageFilter.h"
+#include "itkMetaDataObject.h"
+#include "itkMacro.h"
+#include "AtlasTrace.h"
+
+namespace atlas
+{
+
+// running sum of subject images for template/atlas averaging
+// each image is added into one in-place sum buffer as soon as it is ready, so the caller
+// can release the subject right away- peak memory is the sum plus the subject being added
+// (unlike NaryAddImageFilter, which keeps every input alive until Update())
+// the sum may use a wider pixel type than the subjects (e.g. float subjects, double sum)
+//
+// partial sums of distributed runs are written as shards: an uncompressed NRRD file holding the sum,
+// whose header also records the kind of sum, the number of subjects and their IDs (the geometry is
+// part of any NRRD header). Shards can then be merged without knowing how they were produced and the
+// divisor is simply the merged count.
+//
+// out of core (SetBackingFile): the sum lives in an uncompressed MetaImage file instead of memory and every subject
+// is added slab by slab (read the sum's slab, add, paste it back), so no step holds more than the memory budget of
+// it. AddStreamed takes an unexecuted filter (e.g. a resampler) and pulls it through in the same slabs, and
+// WriteAverage / WriteShard stream from the file into the output
+template < typename TImage, typename TSumImage = TImage >
+class Accumulator
+{
+public:
+	typedef TImage ImageType ;
+	typedef TSumImage SumImageType ;
+	typedef typename SumImageType::Pointer SumImagePointer ;
+	typedef typename SumImageType::PixelType SumPixelType ;
+
+	typedef itk::DivideImageFilter < SumImageType, SumImageType, ImageType > DivideFilterType ;
+
+	Accumulator() : m_Count(0), m_Budget(0) {}
+
+	// keep the sum in filename (.mha: MetaImage reads and writes slabs) and touch at most about budget MB of sum and
+	// subject at a time; call before the first Add. Merging shards and GetSum need the sum in memory
+	void SetBackingFile(const std::string & filename, double budget)
+	{
+		m_BackingFile = filename;
+		m_Budget = budget;
+	}
+
+	bool HasBackingFile() const
+	{
+		return !m_BackingFile.empty();
+	}
+
+	// add one subject to the sum- the first image defines the grid of the sum
+	// safe to call from several subject workers at once
+	void Add(const ImageType * image, const std::string & subject = "")
+	{
+		TraceStage stage("accumulate", subject);
+		std::unique_lock < std::mutex > lock(m_Mutex);
+		if (this->HasBackingFile())
+		{
+			if (this->CreateBackingFile(image))
+			{
+				this->AddSubject(subject);
+				return;
+			}
+			lock.unlock();
+			this->AddSlabs(image, nullptr, lock);
+		} else
+		{
+			this->AddImage(image);
+		}
+		this->AddSubject(subject);
+	}
+
+	// add the output of source (a filter producing an ImageType on the grid of the sum, not yet updated)
+	// with a backing file the filter only ever computes one slab at a time
+	template < typename TSource >
+	void AddStreamed(TSource * source, const std::string & subject = "")
+	{
+		if (!this->HasBackingFile())
+		{
+			source->Update();
+			this->Add(source->GetOutput(), subject);
+			return;
+		}
+		TraceStage stage("accumulate", subject);
+		source->UpdateOutputInformation();
+		std::unique_lock < std::mutex > lock(m_Mutex);
+		if (!this->CreateBackingFile(source->GetOutput()))
+		{
+			lock.unlock();
+			this->AddSlabs(nullptr, source->GetOutput(), lock);
+		}
+		this->AddSubject(subject);
+	}
+
+	// divide the sum by the count and write it to filename
+	// with a backing file this streams slab by slab if filename is in a format ITK writes in pieces (e.g. .mha;
+	// NIfTI can't, so ITK divides all of it at once)
+	void WriteAverage(const std::string & filename) const
+	{
+		if (m_Count == 0)
+		{
+			itkGenericExceptionMacro(<< "nothing accumulated for " << filename);
+		}
+		typedef itk::ImageFileReader < SumImageType > SumReaderType ;
+		typename SumReaderType::Pointer reader = SumReaderType::New();
+		typename DivideFilterType::Pointer divFilter = DivideFilterType::New();
+		unsigned int slabs = 1;
+		if (this->HasBackingFile())
+		{
+			reader->SetFileName(m_BackingFile);
+			reader->UpdateOutputInformation();
+			divFilter->SetInput(reader->GetOutput());
+			slabs = this->GetNumberOfSlabs(reader->GetOutput()->GetLargestPossibleRegion(), sizeof(SumPixelType) + sizeof(typename ImageType::PixelType));
+		} else
+		{
+			divFilter->SetInput(m_Sum);
+		}
+		divFilter->SetConstant(m_Count);
+		TraceStage stage("write", filename);
+		typedef itk::ImageFileWriter < ImageType > AverageWriterType ;
+		typename AverageWriterType::Pointer writer = AverageWriterType::New();
+		writer->SetFileName(filename);
+		writer->SetInput(divFilter->GetOutput());
+		writer->SetNumberOfStreamDivisions(slabs);
+		writer->Update();
+	}
+
+	// number of images added so far
+	unsigned int GetCount() const
+	{
+		return m_Count;
+	}
+
+	// IDs of the subjects added so far (in the order they finished)
+	const std::vector < std::string > & GetSubjects() const
+	{
+		return m_Subjects;
+	}
+
+	// the running sum (null until the first Add)
+	SumImageType * GetSum() const
+	{
+		return m_Sum.GetPointer();
+	}
+
+	// exchange sums, counts and subjects with other (sums in memory)
+	// throws if either sum is kept in a backing file- the file and its slab grid belong to the accumulator
+	void Swap(Accumulator & other)
+	{
+		if (this->HasBackingFile() || other.HasBackingFile())
+		{
+			itkGenericExceptionMacro(<< "can't swap a sum kept in " << (this->HasBackingFile() ? m_BackingFile : other.m_BackingFile));
+		}
+		std::lock(m_Mutex, other.m_Mutex);
+		std::lock_guard < std::mutex > lock(m_Mutex, std::adopt_lock);
+		std::lock_guard < std::mutex > otherLock(other.m_Mutex, std::adopt_lock);
+		std::swap(m_Sum, other.m_Sum);
+		std::swap(m_Count, other.m_Count);
+		m_Subjects.swap(other.m_Subjects);
+	}
+
+	// write the sum and its bookkeeping as a shard; kind tells sums apart, e.g. "a" (affine) or "d" (deformable)
+	void WriteShard(const std::string & filename, const std::string & kind) const
+	{
+		if (m_Count == 0)
+		{
+			itkGenericExceptionMacro(<< "nothing accumulated for " << filename);
+		}
+		std::stringstream count;
+		count << m_Count;
+		std::string subjects;
+		for (size_t k = 0; k < m_Subjects.size(); ++k)
+		{
+			subjects += (k > 0 ? "," : "") + m_Subjects[k];
+		}
+		itk::MetaDataDictionary dictionary;
+		itk::EncapsulateMetaData < std::string >(dictionary, "atlas_kind", kind);
+		itk::EncapsulateMetaData < std::string >(dictionary, "atlas_count", count.str());
+		itk::EncapsulateMetaData < std::string >(dictionary, "atlas_subjects", subjects);
+
+		TraceStage stage("write", filename);
+		typedef itk::ImageFileWriter < SumImageType > ShardWriterType ;
+		typename ShardWriterType::Pointer writer = ShardWriterType::New();
+		writer->SetFileName(filename);
+		writer->UseCompressionOff();
+		if (this->HasBackingFile())
+		{
+			// copied slab by slab through a pass-through filter whose output carries the bookkeeping
+			typedef itk::ImageFileReader < SumImageType > SumReaderType ;
+			typedef itk::CastImageFilter < SumImageType, SumImageType > PassFilterType ;
+			typename SumReaderType::Pointer reader = SumReaderType::New();
+			reader->SetFileName(m_BackingFile);
+			reader->UpdateOutputInformation();
+			typename PassFilterType::Pointer pass = PassFilterType::New();
+			pass->SetInput(reader->GetOutput());
+			pass->InPlaceOff();
+			pass->GetOutput()->SetMetaDataDictionary(dictionary);
+			writer->SetInput(pass->GetOutput());
+			writer->SetNumberOfStreamDivisions(this->GetNumberOfSlabs(reader->GetOutput()->GetLargestPossibleRegion(), sizeof(SumPixelType)));
+		} else
+		{
+			// written through a graft so the sum's own dictionary stays untouched
+			SumImagePointer shard = SumImageType::New();
+			shard->Graft(m_Sum.GetPointer());
+			shard->SetMetaDataDictionary(dictionary);
+			writer->SetInput(shard);
+		}
+		writer->Update();
+	}
+
+	// subjects of a shard written by WriteShard, from its header alone
+	static std::vector < std::string > ReadShardSubjects(const std::string & filename)
+	{
+		typedef itk::ImageFileReader < SumImageType > ShardReaderType ;
+		typename ShardReaderType::Pointer reader = ShardReaderType::New();
+		reader->SetFileName(filename);
+		reader->UpdateOutputInformation();
+		std::string subjects;
+		itk::ExposeMetaData < std::string >(reader->GetOutput()->GetMetaDataDictionary(), "atlas_subjects", subjects);
+		std::vector < std::string > shardSubjects;
+		std::stringstream s(subjects);
+		std::string subject;
+		while (std::getline(s, subject, ','))
+		{
+			shardSubjects.push_back(subject);
+		}
+		return shardSubjects;
+	}
+
+	// add a shard written by WriteShard- the count and subject list grow by the shard's
+	// throws if the shard is of another kind, on another grid or repeats a subject already in the sum
+	void MergeShard(const std::string & filename, const std::string & kind)
+	{
+		if (this->HasBackingFile())
+		{
+			itkGenericExceptionMacro(<< "can't merge " << filename << " into a sum kept in " << m_BackingFile);
+		}
+		TraceStage stage("merge", filename);
+		typedef itk::ImageFileReader < SumImageType > ShardReaderType ;
+		typename ShardReaderType::Pointer reader = ShardReaderType::New();
+		reader->SetFileName(filename);
+		reader->Update();
+		const itk::MetaDataDictionary & dictionary = reader->GetOutput()->GetMetaDataDictionary();
+		std::string shardKind, count, subjects;
+		if (!itk::ExposeMetaData < std::string >(dictionary, "atlas_count", count)
+			|| !itk::ExposeMetaData < std::string >(dictionary, "atlas_kind", shardKind))
+		{
+			itkGenericExceptionMacro(<< filename << " is not a shard (no atlas_count/atlas_kind in its header)");
+		}
+		if (shardKind != kind)
+		{
+			itkGenericExceptionMacro(<< filename << " holds a \"" << shardKind << "\" sum, expected \"" << kind << "\"");
+		}
+		itk::ExposeMetaData < std::string >(dictionary, "atlas_subjects", subjects);
+
+		std::lock_guard < std::mutex > lock(m_Mutex);
+		std::vector < std::string > shardSubjects;
+		std::stringstream s(subjects);
+		std::string subject;
+		while (std::getline(s, subject, ','))
+		{
+			for (size_t k = 0; k < m_Subjects.size(); ++k)
+			{
+				if (m_Subjects[k] == subject)
+				{
+					itkGenericExceptionMacro(<< "subject " << subject << " of " << filename << " is already in the sum");
+				}
+			}
+			shardSubjects.push_back(subject);
+		}
+		this->AddImage(reader->GetOutput());
+		m_Count += atoi(count.c_str());
+		m_Subjects.insert(m_Subjects.end(), shardSubjects.begin(), shardSubjects.end());
+	}
+
+private:
+	typedef typename SumImageType::RegionType RegionType ;
+
+	// count subject in (caller holds the lock)
+	void AddSubject(const std::string & subject)
+	{
+		++m_Count;
+		if (!subject.empty())
+		{
+			m_Subjects.push_back(subject);
+		}
+	}
+
+	// slabs (along the slowest axis) of region that keep bytesPerVoxel per voxel within the budget
+	unsigned int GetNumberOfSlabs(const RegionType & region, double bytesPerVoxel) const
+	{
+		double bytes = static_cast < double >(region.GetNumberOfPixels()) * bytesPerVoxel;
+		double slabs = std::ceil(bytes / (m_Budget * 1024 * 1024));
+		if (m_Budget <= 0 || slabs < 1)
+		{
+			return 1;
+		}
+		return static_cast < unsigned int >(std::min(slabs, static_cast < double >(region.GetSize(SumImageType::ImageDimension - 1))));
+	}
+
+	// the first image of a backed sum becomes the file (streamed through a cast); returns false if the file exists
+	// (caller holds the lock)
+	template < typename TInputImage >
+	bool CreateBackingFile(const TInputImage * image)
+	{
+		if (m_Grid.IsNotNull())
+		{
+			return false;
+		}
+		typedef itk::CastImageFilter < TInputImage, SumImageType > SumCastFilterType ;
+		typename SumCastFilterType::Pointer cast = SumCastFilterType::New();
+		cast->SetInput(image);
+		typedef itk::ImageFileWriter < SumImageType > SumWriterType ;
+		typename SumWriterType::Pointer writer = SumWriterType::New();
+		writer->SetFileName(m_BackingFile);
+		writer->SetInput(cast->GetOutput());
+		writer->UseCompressionOff();
+		writer->SetNumberOfStreamDivisions(this->GetNumberOfSlabs(image->GetLargestPossibleRegion(), sizeof(SumPixelType) + sizeof(typename TInputImage::PixelType)));
+		writer->Update();
+		// geometry only, to check the later images against
+		m_Grid = SumImageType::New();
+		m_Grid->CopyInformation(image);
+		m_Grid->SetRegions(image->GetLargestPossibleRegion());
+		return true;
+	}
+
+	// add an image to the backing file one slab at a time: image if it is in memory, or else the output of a filter
+	// (computed one slab at a time); under the lock each slab of the sum is read, added to and pasted back
+	// returns with the lock held
+	void AddSlabs(const ImageType * image, ImageType * filterOutput, std::unique_lock < std::mutex > & lock)
+	{
+		this->CheckGeometry(filterOutput ? filterOutput : image, m_Grid.GetPointer());
+		RegionType largest = m_Grid->GetLargestPossibleRegion();
+		typename itk::ImageRegionSplitterSlowDimension::Pointer splitter = itk::ImageRegionSplitterSlowDimension::New();
+		unsigned int slabs = splitter->GetNumberOfSplits(largest, this->GetNumberOfSlabs(largest, sizeof(SumPixelType) + sizeof(typename ImageType::PixelType)));
+		typedef itk::ImageFileReader < SumImageType > SumReaderType ;
+		typedef itk::ImageFileWriter < SumImageType > SumWriterType ;
+		for (unsigned int k = 0; k < slabs; ++k)
+		{
+			RegionType region = largest;
+			splitter->GetSplit(k, slabs, region);
+			if (filterOutput)
+			{
+				filterOutput->SetRequestedRegion(region);
+				filterOutput->Update();
+				image = filterOutput;
+			}
+			lock.lock();
+			typename SumReaderType::Pointer reader = SumReaderType::New();
+			reader->SetFileName(m_BackingFile);
+			reader->GetOutput()->SetRequestedRegion(region);
+			reader->Update();
+			SumImagePointer slab = reader->GetOutput();
+			slab->DisconnectPipeline();
+			itk::ImageRegionIterator < SumImageType > sumIt(slab, region);
+			itk::ImageRegionConstIterator < ImageType > imgIt(image, region);
+			for (; !sumIt.IsAtEnd(); ++sumIt, ++imgIt)
+			{
+				sumIt.Set(sumIt.Get() + static_cast < SumPixelType >(imgIt.Get()));
+			}
+			itk::ImageIORegion ioRegion(SumImageType::ImageDimension);
+			for (unsigned int d = 0; d < SumImageType::ImageDimension; ++d)
+			{
+				ioRegion.SetIndex(d, region.GetIndex(d));
+				ioRegion.SetSize(d, region.GetSize(d));
+			}
+			typename SumWriterType::Pointer writer = SumWriterType::New();
+			writer->SetFileName(m_BackingFile);
+			writer->SetInput(slab);
+			writer->SetIORegion(ioRegion);
+			writer->UseCompressionOff();
+			writer->Update();
+			if (k + 1 < slabs)
+			{
+				lock.unlock();
+			}
+		}
+	}
+
+	// add image into the sum (caller holds the lock)
+	template < typename TInputImage >
+	void AddImage(const TInputImage * image)
+	{
+		if (m_Sum.IsNull())
+		{
+			m_Sum = SumImageType::New();
+			m_Sum->CopyInformation(image);
+			m_Sum->SetRegions(image->GetLargestPossibleRegion());
+			m_Sum->Allocate();
+			m_Sum->FillBuffer(0);
+		}
+		this->CheckGeometry(image, m_Sum.GetPointer());
+		itk::ImageRegionIterator < SumImageType > sumIt(m_Sum, m_Sum->GetBufferedRegion());
+		itk::ImageRegionConstIterator < TInputImage > imgIt(image, m_Sum->GetBufferedRegion());
+		for (; !sumIt.IsAtEnd(); ++sumIt, ++imgIt)
+		{
+			sumIt.Set(sumIt.Get() + static_cast < SumPixelType >(imgIt.Get()));
+		}
+	}
+
+	// images must share the grid of the sum (region, and origin/spacing up to rounding)
+	template < typename TInputImage >
+	void CheckGeometry(const TInputImage * image, const SumImageType * grid) const
+	{
+		if (image->GetLargestPossibleRegion() != grid->GetLargestPossibleRegion())
+		{
+			itkGenericExceptionMacro(<< "image region " << image->GetLargestPossibleRegion()
+				<< " does not match accumulated region " << grid->GetLargestPossibleRegion());
+		}
+		for (unsigned int d = 0; d < SumImageType::ImageDimension; ++d)
+		{
+			double tolerance = 1e-4 * grid->GetSpacing()[d];
+			if (std::fabs(image->GetSpacing()[d] - grid->GetSpacing()[d]) > tolerance
+				|| std::fabs(image->GetOrigin()[d] - grid->GetOrigin()[d]) > tolerance)
+			{
+				itkGenericExceptionMacro(<< "image spacing/origin " << image->GetSpacing() << " " << image->GetOrigin()
+					<< " does not match accumulated " << grid->GetSpacing() << " " << grid->GetOrigin());
+			}
+		}
+	}
+
+	SumImagePointer m_Sum ;
+	SumImagePointer m_Grid ; // geometry of a sum kept in m_BackingFile
+	std::string m_BackingFile ;
+	double m_Budget ;
+	unsigned int m_Count ;
+	std::vector < std::string > m_Subjects ;
+	std::mutex m_Mutex ;
+};
+
+} // end namespace atlas
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef AtlasOptions_h
+#define AtlasOptions_h
+
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace atlas
+{
+
+// optional arguments of the form -name=value that follow the positional arguments
+// example: ./Registration KKI2009-05-MPRAGE.nii.gz 1 10 1 0 -jobs=4 -threads=8
+class Options
+{
+public:
+	// parse argv[first] .. argv[argc-1]; returns false (and prints why) on a malformed argument
+	bool Parse(int argc, char * argv[], int first)
+	{
+		for (int k = first; k < argc; ++k)
+		{
+			std::string arg = argv[k];
+			std::string::size_type eq = arg.find('=');
+			if (arg.size() < 2 || arg[0] != '-' || eq == std::string::npos || eq == 1)
+			{
+				std::cout << "bad option " << arg << " (expected -name=value)" << std::endl;
+				return false;
+			}
+			m_Values[arg.substr(1, eq - 1)] = arg.substr(eq + 1);
+		}
+		return true;
+	}
+
+	// set name to value as if -name=value had been given (e.g. options passed from the Python module)
+	void Set(const std::string & name, const std::string & value)
+	{
+		m_Values[name] = value;
+	}
+
+	bool Has(const std::string & name) const
+	{
+		return m_Values.find(name) != m_Values.end();
+	}
+
+	std::string GetString(const std::string & name, const std::string & defaultValue) const
+	{
+		std::map < std::string, std::string >::const_iterator it = m_Values.find(name);
+		return it == m_Values.end() ? defaultValue : it->second;
+	}
+
+	int GetInt(const std::string & name, int defaultValue) const
+	{
+		return this->Has(name) ? atoi(this->GetString(name, "").c_str()) : defaultValue;
+	}
+
+	double GetDouble(const std::string & name, double defaultValue) const
+	{
+		return this->Has(name) ? atof(this->GetString(name, "").c_str()) : defaultValue;
+	}
+
+	// comma separated list, example -shrink=4,2,1
+	std::vector < double > GetDoubleList(const std::string & name) const
+	{
+		std::vector < double > values;
+		std::stringstream s(this->GetString(name, ""));
+		std::string item;
+		while (std::getline(s, item, ','))
+		{
+			if (!item.empty())
+			{
+				values.push_back(atof(item.c_str()));
+			}
+		}
+		return values;
+	}
+
+private:
+	std::map < std::string, std::string > m_Values ;
+};
+
+// value of a per level setting (lists are coarsest level first; a shorter list repeats its last value)
+inline double AtLevel(const std::vector < double > & values, unsigned int level)
+{
+	return values[level < values.size() ? level : values.size() - 1];
+}
+
+} // end namespace atlas
+
+#endif
@@ -0,0 +1,189 @@
+#ifndef AtlasTrace_h
+#define AtlasTrace_h
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+namespace atlas
+{
+
+// process-wide record of where a run spends its time and memory, written as JSON or CSV (-trace=file)
+// stage records: wall and CPU seconds of one stage (read, match, demons, warp, write, ...) of one subject,
+// and the peak resident set size of the process when the stage ended
+// iteration records: metric value and seconds of one optimizer / Demons iteration
+// CPU time is that of the whole process (ITK threads included), so with several subjects running at once
+// (-jobs) it overlaps between the concurrent stages; wall time is always per stage
+// nothing is recorded unless a file name is set
+class Trace
+{
+public:
+	static Trace & GetInstance()
+	{
+		static Trace trace;
+		return trace;
+	}
+
+	// .csv --> CSV, anything else --> JSON; written when the process exits (or by Write)
+	void SetFileName(const std::string & filename)
+	{
+		m_FileName = filename ;
+	}
+	bool IsEnabled() const
+	{
+		return !m_FileName.empty() ;
+	}
+
+	void AddStage(const std::string & stage, const std::string & subject, double wall, double cpu)
+	{
+		Record record = { "stage", stage, subject, 0, 0, wall, cpu, GetPeakRSS() };
+		std::lock_guard < std::mutex > lock(m_Mutex);
+		m_Records.push_back(record);
+	}
+
+	void AddIteration(const std::string & stage, const std::string & subject, unsigned int iteration, double value, double wall)
+	{
+		Record record = { "iteration", stage, subject, iteration, value, wall, 0, 0 };
+		std::lock_guard < std::mutex > lock(m_Mutex);
+		m_Records.push_back(record);
+	}
+
+	void Write()
+	{
+		std::lock_guard < std::mutex > lock(m_Mutex);
+		if (m_FileName.empty())
+		{
+			return;
+		}
+		std::ofstream out(m_FileName.c_str());
+		bool csv = m_FileName.size() > 4 && m_FileName.substr(m_FileName.size() - 4) == ".csv";
+		if (csv)
+		{
+			out << "record,stage,subject,iteration,value,wall_s,cpu_s,peak_rss_kb" << std::endl;
+			for (size_t k = 0; k < m_Records.size(); ++k)
+			{
+				const Record & r = m_Records[k];
+				out << r.type << "," << r.stage << "," << r.subject << "," << r.iteration << "," << r.value << ","
+					<< r.wall << "," << r.cpu << "," << r.peakRSS << std::endl;
+			}
+		} else
+		{
+			out << "{\"records\": [" << std::endl;
+			for (size_t k = 0; k < m_Records.size(); ++k)
+			{
+				const Record & r = m_Records[k];
+				out << "{\"record\": \"" << r.type << "\", \"stage\": \"" << Escape(r.stage) << "\", \"subject\": \"" << Escape(r.subject) << "\", ";
+				if (r.type == std::string("iteration"))
+				{
+					out << "\"iteration\": " << r.iteration << ", \"value\": " << r.value << ", \"wall_s\": " << r.wall;
+				} else
+				{
+					out << "\"wall_s\": " << r.wall << ", \"cpu_s\": " << r.cpu << ", \"peak_rss_kb\": " << r.peakRSS;
+				}
+				out << "}" << (k + 1 < m_Records.size() ? "," : "") << std::endl;
+			}
+			out << "]}" << std::endl;
+		}
+		std::cout << "wrote trace " << m_FileName << " (" << m_Records.size() << " records)" << std::endl;
+		m_FileName.clear();
+	}
+
+	// seconds since an arbitrary start
+	static double GetWallTime()
+	{
+		return std::chrono::duration < double >(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	// user + system seconds of the process
+	static double GetCPUTime()
+	{
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + 1e-6 * (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+	}
+	// kilobytes (Linux reports ru_maxrss in kilobytes)
+	static long GetPeakRSS()
+	{
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_maxrss;
+	}
+
+private:
+	struct Record
+	{
+		const char * type ;
+		std::string stage ;
+		std::string subject ;
+		unsigned int iteration ;
+		double value ;
+		double wall ;
+		double cpu ;
+		long peakRSS ;
+	};
+
+	Trace() {}
+	~Trace()
+	{
+		this->Write();
+	}
+
+	static std::string Escape(const std::string & value)
+	{
+		std::string escaped;
+		for (size_t k = 0; k < value.size(); ++k)
+		{
+			if (value[k] == '"' || value[k] == '\\')
+			{
+				escaped += '\\';
+			}
+			escaped += value[k];
+		}
+		return escaped;
+	}
+
+	std::string m_FileName ;
+	std::vector < Record > m_Records ;
+	std::mutex m_Mutex ;
+};
+
+// times the enclosing scope as one stage record
+// example: { atlas::TraceStage stage("read", subject); reader->Update(); }
+class TraceStage
+{
+public:
+	explicit TraceStage(const std::string & stage, const std::string & subject = "")
+		: m_Enabled(Trace::GetInstance().IsEnabled()), m_Stage(stage), m_Subject(subject), m_Wall(0), m_CPU(0)
+	{
+		if (m_Enabled)
+		{
+			m_Wall = Trace::GetWallTime();
+			m_CPU = Trace::GetCPUTime();
+		}
+	}
+	~TraceStage()
+	{
+		if (m_Enabled)
+		{
+			Trace::GetInstance().AddStage(m_Stage, m_Subject, Trace::GetWallTime() - m_Wall, Trace::GetCPUTime() - m_CPU);
+		}
+	}
+
+private:
+	TraceStage(const TraceStage &);
+	TraceStage & operator=(const TraceStage &);
+
+	bool m_Enabled ;
+	std::string m_Stage ;
+	std::string m_Subject ;
+	double m_Wall ;
+	double m_CPU ;
+};
+
+} // end namespace atlas
+
+#endif
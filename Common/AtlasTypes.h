@@ -0,0 +1,32 @@
+#ifndef AtlasTypes_h
+#define AtlasTypes_h
+
+// pixel precision of the pipelines, chosen at compile time
+// each CMake project builds a double target (e.g. Registration) and a float target (e.g. RegistrationFloat)
+// which defines ATLAS_PIXEL_TYPE=float; any of these can also be overridden by hand with -D
+
+// image intensities (reading, metric, resampling, warping, writing)
+#ifndef ATLAS_PIXEL_TYPE
+#define ATLAS_PIXEL_TYPE double
+#endif
+
+// components of the Demons displacement field
+#ifndef ATLAS_FIELD_TYPE
+#define ATLAS_FIELD_TYPE ATLAS_PIXEL_TYPE
+#endif
+
+// running template sum- stays double by default so averaging many float subjects keeps its accuracy
+#ifndef ATLAS_SUM_TYPE
+#define ATLAS_SUM_TYPE double
+#endif
+
+namespace atlas
+{
+
+typedef ATLAS_PIXEL_TYPE PixelType ;
+typedef ATLAS_FIELD_TYPE FieldComponentType ;
+typedef ATLAS_SUM_TYPE SumPixelType ;
+
+} // end namespace atlas
+
+#endif
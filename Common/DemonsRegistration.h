@@ -0,0 +1,670 @@
+#ifndef DemonsRegistration_h
+#define DemonsRegistration_h
+
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "itkImage.h"
+#include "itkImageFileWriter.h"
+#include "itkImageDuplicator.h"
+#include "itkShrinkImageFilter.h"
+#include "itkSymmetricForcesDemonsRegistrationFilter.h"
+#include "itkMultiResolutionPDEDeformableRegistration.h"
+#include "itkHistogramMatchingImageFilter.h"
+#include "itkWarpImageFilter.h"
+#include "itkResampleImageFilter.h"
+#include "itkNearestNeighborExtrapolateImageFunction.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkCommand.h"
+#include "AtlasOptions.h"
+#include "ResultStore.h"
+#include "FixedImageCache.h"
+#include "ForegroundMask.h"
+#include "SnapshotWriter.h"
+#include "AtlasTrace.h"
+#include "SubjectWorkerPool.h"
+
+namespace atlas
+{
+
+// settings of the deformable stage (defaults are the values dRegistration always used)
+struct DemonsSettings
+{
+	DemonsSettings() : iterations(60), standardDeviations(1.0), histogramLevels(1024), matchPoints(7), levels(1),
+		maximumRMSError(0), plateauIterations(0), plateauTolerance(0.001), fieldShrink(1), mask(false),
+		maskPadding(10), observe(false),
+		snapshotInterval(20), snapshotShrink(1), snapshotWriter(nullptr) {}
+	unsigned int iterations ; // at full resolution
+	double standardDeviations ;
+	unsigned int histogramLevels ;
+	unsigned int matchPoints ;
+	unsigned int levels ; // > 1 --> multi-resolution Demons on a pyramid of levels (each halving the grid)
+	std::vector < double > levelIterations ; // iterations per level, coarsest first (empty --> iterations at every level)
+	double maximumRMSError ; // a level stops once the RMS change of the field per iteration is below this (0 --> off)
+	unsigned int plateauIterations ; // a level stops once the metric improved by less than plateauTolerance
+	double plateauTolerance ; // (relative) over the last plateauIterations iterations (0 --> off)
+	unsigned int fieldShrink ; // keep, store and warp with the field on a grid shrunk by this factor
+	bool mask ; // Demons only on the padded bounding box of the foreground of both images (zero field outside)
+	double maskPadding ; // mm added around the foreground box
+	bool observe ; // write intermediate warped images at iteration 1 and every snapshotInterval iterations
+	unsigned int snapshotInterval ;
+	unsigned int snapshotShrink ; // snapshots on a grid shrunk by this factor
+	SnapshotWriter * snapshotWriter ; // background writer of the snapshots (null --> written by the registration thread)
+};
+
+// fill the Demons and snapshot settings from the options (see README); the writer is left to the caller
+inline void ReadDemonsSettings(const Options & options, DemonsSettings & settings)
+{
+	// one value or one per level (coarsest first), the last one being full resolution
+	std::vector < double > iterations = options.GetDoubleList("demonsIterations");
+	if (!iterations.empty()) {
+		settings.levelIterations = iterations;
+		settings.iterations = static_cast < unsigned int >(iterations.back());
+	}
+	settings.standardDeviations = options.GetDouble("demonsSigma", settings.standardDeviations);
+	settings.levels = options.GetInt("demonsLevels", settings.levels);
+	settings.maximumRMSError = options.GetDouble("demonsRMS", settings.maximumRMSError);
+	settings.plateauIterations = options.GetInt("demonsPlateau", settings.plateauIterations);
+	settings.plateauTolerance = options.GetDouble("demonsPlateauTolerance", settings.plateauTolerance);
+	settings.fieldShrink = options.GetInt("fieldShrink", settings.fieldShrink);
+	settings.mask = options.GetInt("mask", 0);
+	settings.maskPadding = options.GetDouble("maskPadding", settings.maskPadding);
+	settings.snapshotInterval = options.GetInt("snapshotInterval", 20);
+	settings.snapshotShrink = options.GetInt("snapshotShrink", 1);
+	if (settings.levels < 1) {
+		settings.levels = 1;
+	}
+	if (settings.fieldShrink < 1) {
+		settings.fieldShrink = 1;
+	}
+	if (settings.snapshotInterval < 1) {
+		settings.snapshotInterval = 1;
+	}
+	if (settings.snapshotShrink < 1) {
+		settings.snapshotShrink = 1;
+	}
+}
+
+// Demons iterations at level (0 = coarsest, levels - 1 = full resolution)
+inline unsigned int DemonsIterationsAtLevel(const DemonsSettings & settings, unsigned int level)
+{
+	if (level + 1 < settings.levels && !settings.levelIterations.empty()) {
+		return static_cast < unsigned int >(AtLevel(settings.levelIterations, level));
+	}
+	return settings.iterations;
+}
+
+// the settings that change the registration result (not observe)
+inline void HashDemonsSettings(Hash & hash, const DemonsSettings & settings)
+{
+	hash.Add("demons");
+	hash.Add(static_cast < double >(settings.iterations));
+	hash.Add(settings.standardDeviations);
+	hash.Add(static_cast < double >(settings.histogramLevels));
+	hash.Add(static_cast < double >(settings.matchPoints));
+	// only hashed when used, so results stored before these settings existed are still found
+	if (settings.levels > 1) {
+		hash.Add("levels");
+		for (unsigned int level = 0; level < settings.levels; ++level) {
+			hash.Add(static_cast < double >(DemonsIterationsAtLevel(settings, level)));
+		}
+	}
+	if (settings.maximumRMSError > 0) {
+		hash.Add("rms");
+		hash.Add(settings.maximumRMSError);
+	}
+	if (settings.plateauIterations > 0 && settings.plateauTolerance > 0) {
+		hash.Add("plateau");
+		hash.Add(static_cast < double >(settings.plateauIterations));
+		hash.Add(settings.plateauTolerance);
+	}
+	if (settings.fieldShrink > 1) {
+		hash.Add("fieldShrink");
+		hash.Add(static_cast < double >(settings.fieldShrink));
+	}
+	if (settings.mask) {
+		hash.Add("mask");
+		hash.Add(settings.maskPadding);
+	}
+}
+
+// used code from: https://itk.org/Doxygen/html/Examples_2RegistrationITKv3_2DeformableRegistration3_8cxx-example.html to set up the registration and part of callback
+// the callback for writing images during deformable registration- observer added if observe flag is set by user
+// at iteration 1 and every interval iterations it copies the current field (shrunk if asked) and hands the warp and
+// write of <subject>_out<N>.nii.gz to the snapshot writer, so Demons only waits for the copy
+template < typename TImage, typename TDisplacementField >
+class CommandIterationUpdate : public itk::Command
+{
+	public:
+	typedef CommandIterationUpdate Self ;
+	typedef itk::Command Superclass ;
+	typedef itk::SmartPointer<Self> Pointer ;
+	itkNewMacro(CommandIterationUpdate);
+
+	protected:
+	typedef TImage ImageType;
+	typedef TDisplacementField DisplacementFieldType;
+	typedef itk::SymmetricForcesDemonsRegistrationFilter<ImageType, ImageType, DisplacementFieldType> RegistrationFilterType;
+	typedef itk::WarpImageFilter<ImageType, ImageType, DisplacementFieldType> WarperType;
+	typedef itk::LinearInterpolateImageFunction< ImageType, double> InterpolatorType;
+	typedef itk::ImageFileWriter < ImageType > ImageWriterType ;
+	typedef itk::ImageDuplicator < DisplacementFieldType > DuplicatorType ;
+	typedef itk::ImageDuplicator < ImageType > ImageDuplicatorType ;
+	typedef itk::ShrinkImageFilter < DisplacementFieldType, DisplacementFieldType > ShrinkFilterType ;
+
+	CommandIterationUpdate() : m_Interval(20), m_Shrink(1), m_Levels(1), m_Level(-1), m_CopiedLevel(-1), m_Writer(nullptr) {}
+
+	public:
+	// prefix of the snapshot names (several subjects may be registering at once)
+	void SetSubject(const std::string & subject)
+	{
+		m_Subject = subject ;
+	}
+	void SetSettings(const DemonsSettings & settings)
+	{
+		m_Interval = settings.snapshotInterval ;
+		m_Shrink = settings.snapshotShrink ;
+		m_Levels = settings.levels ;
+		m_Writer = settings.snapshotWriter ;
+	}
+
+	void Execute(itk::Object * caller, const itk::EventObject & event)
+	{
+		Execute( (const itk::Object *)caller, event);
+	}
+
+	void Execute(const itk::Object * object, const itk::EventObject & event)
+	{
+		const RegistrationFilterType * filter =  static_cast< const RegistrationFilterType * >( object );
+		unsigned int currentIteration = filter->GetElapsedIterations();
+		// multi-resolution: the iterations restart at every level
+		if (currentIteration == 1) {
+			++m_Level;
+		}
+		std::cout << m_Subject << (m_Subject.empty() ? "" : " ") << "elapsed iterations " << currentIteration << std::endl;
+		if (currentIteration == 1 || currentIteration % m_Interval == 0){
+
+			// copy what the snapshot needs- the registration keeps updating its field, and its moving image is the
+			// output of the histogram matcher (or of the pyramid, a new one each level) that the registration thread
+			// updates; a background warp must not run those pipelines, so it gets a disconnected copy (one per level)
+			typename ImageType::ConstPointer movingImage = static_cast <const ImageType *>(filter->GetMovingImage());
+			if (m_Writer) {
+				if (m_CopiedLevel != m_Level) {
+					typename ImageDuplicatorType::Pointer duplicator = ImageDuplicatorType::New();
+					duplicator->SetInputImage(movingImage);
+					duplicator->Update();
+					m_MovingCopy = duplicator->GetOutput();
+					m_CopiedLevel = m_Level;
+				}
+				movingImage = m_MovingCopy;
+			}
+			typename DisplacementFieldType::Pointer field;
+			if (m_Shrink > 1) {
+				typename ShrinkFilterType::Pointer shrinker = ShrinkFilterType::New();
+				shrinker->SetInput(filter->GetOutput());
+				shrinker->SetShrinkFactors(m_Shrink);
+				shrinker->Update();
+				field = shrinker->GetOutput();
+				field->DisconnectPipeline();
+			} else {
+				typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
+				duplicator->SetInputImage(filter->GetOutput());
+				duplicator->Update();
+				field = duplicator->GetOutput();
+			}
+			std::stringstream itnum;
+			if (m_Levels > 1) {
+				itnum << "L" << m_Level << "_";
+			}
+			itnum << currentIteration;
+			std::string fname = (m_Subject.empty() ? "" : m_Subject + "_") + "out" + itnum.str() + ".nii.gz";
+
+			std::string subject = m_Subject;
+			auto snapshot = [movingImage, field, fname, subject]()
+			{
+				TraceStage stage("snapshot", subject);
+				// warp onto the grid of the (possibly shrunk) field
+				typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
+				typename WarperType::Pointer warper = WarperType::New();
+				warper->SetInput(movingImage);
+				warper->SetInterpolator(interpolator) ;
+				warper->SetOutputSpacing(field->GetSpacing());
+				warper->SetOutputOrigin(field->GetOrigin());
+				warper->SetOutputDirection(field->GetDirection());
+				warper->SetDisplacementField(field);
+				// write image with transform at current iteration
+				typename ImageWriterType::Pointer writer = ImageWriterType::New();
+				writer->SetFileName(fname);
+				writer->SetInput(warper->GetOutput());
+				writer->Update();
+				std::cout << "wrote " << fname << std::endl;
+			};
+			if (m_Writer) {
+				m_Writer->Push(snapshot);
+			} else {
+				snapshot();
+			}
+		}
+	}
+
+	private:
+	std::string m_Subject ;
+	unsigned int m_Interval ;
+	unsigned int m_Shrink ;
+	unsigned int m_Levels ;
+	int m_Level ;
+	int m_CopiedLevel ;
+	typename ImageType::Pointer m_MovingCopy ;
+	SnapshotWriter * m_Writer ;
+};
+
+// records the Demons metric and the time of every iteration in the trace (-trace)
+template < typename TImage, typename TDisplacementField >
+class DemonsIterationTrace : public itk::Command
+{
+	public:
+	typedef DemonsIterationTrace Self ;
+	typedef itk::Command Superclass ;
+	typedef itk::SmartPointer<Self> Pointer ;
+	itkNewMacro(DemonsIterationTrace);
+
+	typedef itk::SymmetricForcesDemonsRegistrationFilter<TImage, TImage, TDisplacementField> RegistrationFilterType;
+
+	void SetSubject(const std::string & subject)
+	{
+		m_Subject = subject ;
+	}
+
+	void Execute(itk::Object * caller, const itk::EventObject & event)
+	{
+		Execute( (const itk::Object *)caller, event);
+	}
+
+	void Execute(const itk::Object * object, const itk::EventObject & event)
+	{
+		const RegistrationFilterType * filter =  static_cast< const RegistrationFilterType * >( object );
+		double now = Trace::GetWallTime();
+		Trace::GetInstance().AddIteration("demons", m_Subject, filter->GetElapsedIterations(), filter->GetMetric(), m_Last > 0 ? now - m_Last : 0);
+		m_Last = now;
+	}
+
+	protected:
+	DemonsIterationTrace() : m_Last(0) {}
+
+	private:
+	std::string m_Subject ;
+	double m_Last ;
+};
+
+// stops a Demons level once its metric stops improving: when the metric improved by less than tolerance
+// (relative) over the last window iterations, and counts the voxel iterations run (levels and early stops included)
+template < typename TImage, typename TDisplacementField >
+class DemonsConvergenceCommand : public itk::Command
+{
+	public:
+	typedef DemonsConvergenceCommand Self ;
+	typedef itk::Command Superclass ;
+	typedef itk::SmartPointer<Self> Pointer ;
+	itkNewMacro(DemonsConvergenceCommand);
+
+	typedef itk::SymmetricForcesDemonsRegistrationFilter<TImage, TImage, TDisplacementField> RegistrationFilterType;
+
+	void SetSubject(const std::string & subject)
+	{
+		m_Subject = subject ;
+	}
+	// window 0 --> never stop
+	void SetPlateau(unsigned int window, double tolerance)
+	{
+		m_Window = window ;
+		m_Tolerance = tolerance ;
+	}
+	double GetVoxelIterations() const
+	{
+		return m_VoxelIterations ;
+	}
+
+	void Execute(itk::Object * caller, const itk::EventObject & event)
+	{
+		RegistrationFilterType * filter = static_cast< RegistrationFilterType * >( caller );
+		unsigned int currentIteration = filter->GetElapsedIterations();
+		m_VoxelIterations += static_cast < double >(filter->GetOutput()->GetBufferedRegion().GetNumberOfPixels());
+		if (currentIteration == 1) {
+			// new level
+			m_Metrics.clear();
+		}
+		m_Metrics.push_back(filter->GetMetric());
+		if (m_Window == 0 || m_Tolerance <= 0 || m_Metrics.size() <= m_Window) {
+			return;
+		}
+		// the Demons metric is a mean squared difference, lower is better
+		double before = m_Metrics[m_Metrics.size() - 1 - m_Window];
+		if (before - m_Metrics.back() <= m_Tolerance * std::abs(before)) {
+			std::cout << m_Subject << (m_Subject.empty() ? "" : " ") << "metric plateau at iteration " << currentIteration
+				<< " (" << before << " --> " << m_Metrics.back() << "), stopping level" << std::endl;
+			filter->StopRegistration();
+		}
+	}
+
+	void Execute(const itk::Object *, const itk::EventObject &)
+	{
+		// a const caller can't be stopped
+	}
+
+	protected:
+	DemonsConvergenceCommand() : m_Window(0), m_Tolerance(0), m_VoxelIterations(0) {}
+
+	private:
+	std::string m_Subject ;
+	unsigned int m_Window ;
+	double m_Tolerance ;
+	double m_VoxelIterations ;
+	std::vector < double > m_Metrics ;
+};
+
+// deformable registration of one moving image to a fixed image:
+// histogram matching of the moving image to the fixed image, symmetric forces demons (on a pyramid with
+// demonsLevels > 1; levels stop early on the RMS change or metric plateau thresholds), then warping of the (unmatched) moving image onto the fixed grid
+// shared by dRegistration and the fused affine -> deformable mode of Registration
+template < typename TImage, typename TDisplacementField >
+class DemonsRegistration
+{
+public:
+	typedef TImage ImageType ;
+	typedef typename ImageType::Pointer ImagePointer ;
+	typedef TDisplacementField DisplacementFieldType ;
+	typedef typename DisplacementFieldType::Pointer DisplacementFieldPointer ;
+	typedef itk::HistogramMatchingImageFilter <ImageType, ImageType> MatchingFilterType;
+	typedef itk::SymmetricForcesDemonsRegistrationFilter<ImageType, ImageType, DisplacementFieldType> RegistrationFilterType;
+	typedef itk::WarpImageFilter<ImageType, ImageType, DisplacementFieldType> WarperType;
+	typedef itk::LinearInterpolateImageFunction< ImageType, double> InterpolatorType;
+	typedef itk::ShrinkImageFilter < DisplacementFieldType, DisplacementFieldType > FieldShrinkerType ;
+	typedef itk::ResampleImageFilter < DisplacementFieldType, DisplacementFieldType > FieldResamplerType ;
+	typedef itk::LinearInterpolateImageFunction < DisplacementFieldType, double > FieldInterpolatorType ;
+	typedef itk::NearestNeighborExtrapolateImageFunction < DisplacementFieldType, double > FieldExtrapolatorType ;
+	typedef CommandIterationUpdate < ImageType, DisplacementFieldType > IterationCommandType ;
+	typedef DemonsIterationTrace < ImageType, DisplacementFieldType > IterationTraceType ;
+	typedef DemonsConvergenceCommand < ImageType, DisplacementFieldType > ConvergenceCommandType ;
+	typedef FixedImageCache < ImageType > FixedImageCacheType ;
+	typedef ForegroundMask < ImageType > ForegroundMaskType ;
+	// the pyramid works on images of the real type, so it is the pixel type (no casts, the level images are ImageType)
+	typedef itk::MultiResolutionPDEDeformableRegistration < ImageType, ImageType, DisplacementFieldType, typename ImageType::PixelType > MultiResolutionType ;
+
+	DemonsRegistration(const ImageType * fixedImage, const DemonsSettings & settings)
+		: m_FixedImage(fixedImage), m_Settings(settings), m_Cache(nullptr), m_VoxelIterations(0) {}
+
+	// name of the snapshots and progress lines of the observer
+	void SetSubject(const std::string & subject)
+	{
+		m_Subject = subject ;
+	}
+
+	// take the reference histogram of the matching from cache (built once for all subjects, ITK >= 5.1)
+	// cache must be of the fixed image; throws itk::ExceptionObject otherwise
+	void SetFixedImageCache(FixedImageCacheType * cache)
+	{
+		if (cache && cache->GetFixedImage() != m_FixedImage) {
+			itkGenericExceptionMacro(<< "fixed image cache of another image");
+		}
+		m_Cache = cache ;
+	}
+
+	// start Demons from field (e.g. the subject's result of an earlier run) instead of a zero field
+	// the field must be on the fixed grid; Demons may update it in place
+	void SetInitialDisplacementField(DisplacementFieldType * field)
+	{
+		m_InitialDisplacementField = field ;
+	}
+
+	// register moving to the fixed image; throws itk::ExceptionObject if the registration fails
+	void Update(const ImageType * moving)
+	{
+		// the filters run on grafts: the fixed image is shared with the other subject workers (see GraftImage)
+		ImagePointer fixedGraft = GraftImage(m_FixedImage);
+		ImagePointer movingGraft = GraftImage(moving);
+		const ImageType * movingImage = movingGraft.GetPointer();
+		// intensity matching of fixed and moving images
+		typename MatchingFilterType::Pointer matcher = MatchingFilterType::New();
+		matcher->SetInput(movingImage);
+		matcher->SetReferenceImage(fixedGraft.GetPointer());
+		matcher->SetNumberOfHistogramLevels(m_Settings.histogramLevels);
+		matcher->SetNumberOfMatchPoints(m_Settings.matchPoints);
+		matcher->ThresholdAtMeanIntensityOn();
+#ifdef ATLAS_REFERENCE_HISTOGRAM
+		if (m_Cache) {
+			matcher->SetReferenceHistogram(m_Cache->GetReferenceHistogram(m_Settings.histogramLevels, m_Settings.matchPoints));
+			matcher->SetGenerateReferenceHistogramFromImage(false);
+		}
+#endif
+		{
+			TraceStage stage("match", m_Subject);
+			matcher->Update();
+		}
+		// foreground (-mask): Demons runs on the padded bounding box of both heads only (matching is done on the
+		// full images first, as the reference histogram is of the full fixed image)
+		const ImageType * fixedImage = fixedGraft.GetPointer();
+		const ImageType * matchedImage = matcher->GetOutput();
+		DisplacementFieldPointer initialField = m_InitialDisplacementField;
+		ImagePointer fixedCrop;
+		ImagePointer movingCrop;
+		if (m_Settings.mask) {
+			typename ImageType::RegionType box = m_Cache ? m_Cache->GetForegroundBox(m_Settings.maskPadding)
+				: ForegroundMaskType::GetBoundingBox(ForegroundMaskType::GetMask(fixedGraft.GetPointer()), m_Settings.maskPadding);
+			box = ForegroundMaskType::GetUnion(box, ForegroundMaskType::GetBoundingBox(ForegroundMaskType::GetMask(movingImage), m_Settings.maskPadding));
+			fixedCrop = ForegroundMaskType::Crop(fixedGraft.GetPointer(), box);
+			movingCrop = ForegroundMaskType::Crop(matchedImage, box);
+			fixedImage = fixedCrop;
+			matchedImage = movingCrop;
+			if (initialField.IsNotNull()) {
+				initialField = ForegroundMaskType::Crop(initialField.GetPointer(), box);
+			}
+		}
+		typename RegistrationFilterType::Pointer dregistration = RegistrationFilterType::New();
+
+		// add callback based on observer flag
+		if (m_Settings.observe) {
+			typename IterationCommandType::Pointer observer = IterationCommandType::New();
+			observer->SetSubject(m_Subject);
+			observer->SetSettings(m_Settings);
+			dregistration->AddObserver(itk::IterationEvent(), observer);
+		}
+		if (Trace::GetInstance().IsEnabled()) {
+			typename IterationTraceType::Pointer iterationTrace = IterationTraceType::New();
+			iterationTrace->SetSubject(m_Subject);
+			dregistration->AddObserver(itk::IterationEvent(), iterationTrace);
+		}
+		typename ConvergenceCommandType::Pointer convergence = ConvergenceCommandType::New();
+		convergence->SetSubject(m_Subject);
+		convergence->SetPlateau(m_Settings.plateauIterations, m_Settings.plateauTolerance);
+		dregistration->AddObserver(itk::IterationEvent(), convergence);
+		dregistration->SetStandardDeviations(m_Settings.standardDeviations);
+		// every level stops early once the field changes less than this per iteration (0 never)
+		dregistration->SetMaximumRMSError(m_Settings.maximumRMSError);
+		if (m_Settings.levels > 1) {
+			// coarse to fine: the pyramid of both images is built once, the field of each level is upsampled
+			// to start the next, so most of the deformation is found on the coarse grids
+			typename MultiResolutionType::Pointer multiResolution = MultiResolutionType::New();
+			multiResolution->SetRegistrationFilter(dregistration);
+			multiResolution->SetFixedImage(fixedImage);
+			multiResolution->SetMovingImage(matchedImage);
+			multiResolution->SetNumberOfLevels(m_Settings.levels);
+			std::vector < unsigned int > iterations(m_Settings.levels);
+			for (unsigned int level = 0; level < m_Settings.levels; ++level) {
+				iterations[level] = DemonsIterationsAtLevel(m_Settings, level);
+			}
+			multiResolution->SetNumberOfIterations(&iterations[0]);
+			if (initialField.IsNotNull()) {
+				// shrunk onto the coarsest grid by the filter
+				multiResolution->SetArbitraryInitialDisplacementField(initialField);
+			}
+			{
+				TraceStage stage("demons", m_Subject);
+				multiResolution->Update();
+			}
+			m_DisplacementField = multiResolution->GetOutput();
+		} else {
+			dregistration->SetFixedImage(fixedImage);
+			dregistration->SetMovingImage(matchedImage);
+			dregistration->SetNumberOfIterations(m_Settings.iterations);
+			if (initialField.IsNotNull()) {
+				dregistration->SetInitialDisplacementField(initialField);
+			}
+			{
+				TraceStage stage("demons", m_Subject);
+				dregistration->Update();
+			}
+			m_DisplacementField = dregistration->GetOutput();
+		}
+		m_DisplacementField->DisconnectPipeline();
+		m_VoxelIterations = convergence->GetVoxelIterations();
+		if (m_Settings.mask) {
+			// back onto the full fixed grid, no displacement outside the box
+			dregistration = nullptr;
+			m_DisplacementField = ForegroundMaskType::Pad(m_DisplacementField.GetPointer(), fixedGraft.GetPointer());
+		}
+		if (m_Settings.fieldShrink > 1) {
+			// free the Demons buffers before the full field is replaced by the compact one
+			dregistration = nullptr;
+			m_DisplacementField = ShrinkField(m_DisplacementField, m_Settings.fieldShrink);
+		}
+
+		m_Output = Warp(movingImage, m_DisplacementField, fixedGraft.GetPointer(), m_Subject);
+	}
+
+	// moving image warped with field onto the grid of reference
+	static ImagePointer Warp(const ImageType * movingImage, const DisplacementFieldType * field, const ImageType * reference,
+		const std::string & subject = "")
+	{
+		TraceStage stage("warp", subject);
+		typename WarperType::Pointer warper = WarperType::New();
+		typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
+		warper->SetInput(movingImage);
+		warper->SetInterpolator(interpolator);
+		warper->SetOutputSpacing(reference->GetSpacing());
+		warper->SetOutputOrigin(reference->GetOrigin());
+		warper->SetOutputDirection(reference->GetDirection());
+		warper->SetOutputStartIndex(reference->GetLargestPossibleRegion().GetIndex());
+		warper->SetOutputSize(reference->GetLargestPossibleRegion().GetSize());
+		// a field on another (e.g. shrunk) grid is interpolated at every output voxel
+		warper->SetDisplacementField(field);
+		warper->Update();
+		ImagePointer output = warper->GetOutput();
+		output->DisconnectPipeline();
+		return output;
+	}
+
+	// field subsampled by factor (compact storage: 1 / factor^3 of the voxels)
+	// the Demons field is smoothed every iteration, so little is lost for small factors
+	static DisplacementFieldPointer ShrinkField(const DisplacementFieldType * field, unsigned int factor)
+	{
+		typename FieldShrinkerType::Pointer shrinker = FieldShrinkerType::New();
+		shrinker->SetInput(field);
+		shrinker->SetShrinkFactors(factor);
+		shrinker->Update();
+		DisplacementFieldPointer shrunk = shrinker->GetOutput();
+		shrunk->DisconnectPipeline();
+		return shrunk;
+	}
+
+	// field (linearly) interpolated onto the grid of reference, e.g. to start Demons from a compact field
+	static DisplacementFieldPointer ExpandField(const DisplacementFieldType * field, const ImageType * reference)
+	{
+		typename FieldResamplerType::Pointer resampler = FieldResamplerType::New();
+		typename DisplacementFieldType::PixelType zero;
+		zero.Fill(0);
+		resampler->SetInput(field);
+		resampler->SetInterpolator(FieldInterpolatorType::New());
+		// the border voxels of the reference lie outside the centres of the shrunk grid
+		resampler->SetExtrapolator(FieldExtrapolatorType::New());
+		resampler->SetDefaultPixelValue(zero);
+		resampler->SetOutputParametersFromImage(reference);
+		resampler->Update();
+		DisplacementFieldPointer expanded = resampler->GetOutput();
+		expanded->DisconnectPipeline();
+		return expanded;
+	}
+
+	// the moving image warped onto the fixed grid
+	ImageType * GetOutput() const
+	{
+		return m_Output.GetPointer();
+	}
+
+	// the field on the fixed grid, or shrunk by fieldShrink
+	DisplacementFieldType * GetDisplacementField() const
+	{
+		return m_DisplacementField.GetPointer();
+	}
+
+	// voxels times iterations Demons ran, over all levels (less than the settings ask for after early stops)
+	double GetVoxelIterations() const
+	{
+		return m_VoxelIterations;
+	}
+
+private:
+	const ImageType * m_FixedImage ;
+	DemonsSettings m_Settings ;
+	FixedImageCacheType * m_Cache ;
+	std::string m_Subject ;
+	DisplacementFieldPointer m_InitialDisplacementField ;
+	DisplacementFieldPointer m_DisplacementField ;
+	ImagePointer m_Output ;
+	double m_VoxelIterations ;
+};
+
+// moving image of subject deformably registered and warped through the result store: warped with the stored field
+// if the fixed image, the moving image and the settings are unchanged since it was stored, otherwise a new
+// registration (warm-started from the subject's last stored field, interpolated onto the fixed grid if it is on
+// another one) whose field is stored
+// with the store disabled this is just DemonsRegistration
+// cache (optional) holds what is computed from the fixed image alone, shared by the subjects
+template < typename TImage, typename TDisplacementField >
+typename TImage::Pointer RegisterDemons(const ResultStore & store, const std::string & subject, const TImage * fixedImage,
+	const TImage * movingImage, const DemonsSettings & settings, FixedImageCache < TImage > * cache = nullptr)
+{
+	typedef DemonsRegistration < TImage, TDisplacementField > RegistrationType ;
+	std::string key;
+	if (store.IsEnabled())
+	{
+		// the fixed image is hashed once per run by the cache, only the moving image for every subject
+		Hash hash;
+		hash.Add(GetFixedImageDigest(fixedImage, cache));
+		hash.AddImage(movingImage);
+		HashDemonsSettings(hash, settings);
+		key = hash.GetDigest();
+		if (store.Has(subject, "demons", key, "nrrd"))
+		{
+			typename TDisplacementField::Pointer field = store.template ReadImage < TDisplacementField >(subject, "demons", key);
+			std::cout << subject << " unchanged, reusing " << store.GetPath(subject, "demons", key, "nrrd") << std::endl;
+			return RegistrationType::Warp(movingImage, field, fixedImage, subject);
+		}
+	}
+	RegistrationType registration(fixedImage, settings);
+	registration.SetSubject(subject);
+	registration.SetFixedImageCache(cache);
+	std::string previous = store.GetLatestKey(subject, "demons");
+	if (!previous.empty() && store.Has(subject, "demons", previous, "nrrd"))
+	{
+		typename TDisplacementField::Pointer field = store.template ReadImage < TDisplacementField >(subject, "demons", previous);
+		if (field->GetLargestPossibleRegion() != fixedImage->GetLargestPossibleRegion())
+		{
+			// compact (-fieldShrink) or from a template on another grid
+			field = RegistrationType::ExpandField(field, fixedImage);
+		}
+		registration.SetInitialDisplacementField(field);
+		std::cout << subject << " warm start from " << store.GetPath(subject, "demons", previous, "nrrd") << std::endl;
+	}
+	registration.Update(movingImage);
+	if (store.IsEnabled())
+	{
+		store.WriteImage(subject, "demons", key, registration.GetDisplacementField());
+	}
+	return registration.GetOutput();
+}
+
+} // end namespace atlas
+
+#endif
@@ -0,0 +1,269 @@
+#ifndef FixedImageCache_h
+#define FixedImageCache_h
+
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "itkImage.h"
+#include "itkHistogramMatchingImageFilter.h"
+#include "itkMultiResolutionPyramidImageFilter.h"
+#include "SmoothingPyramidImageFilter.h"
+#include "MetricSampler.h"
+#include "ForegroundMask.h"
+#include "ResultStore.h"
+#include "AtlasTrace.h"
+
+// HistogramMatchingImageFilter takes a precomputed reference histogram from ITK 5.1 on
+#if ITK_VERSION_MAJOR > 5 || (ITK_VERSION_MAJOR == 5 && ITK_VERSION_MINOR >= 1)
+#define ATLAS_REFERENCE_HISTOGRAM 1
+#endif
+
+namespace atlas
+{
+
+// what the registrations compute from the fixed image alone, computed once per run and shared by every subject:
+// - the smoothed and shrunk pyramid levels of the affine stage
+// - the metric sample indexes of each level
+// - the reference histogram (and so quantiles) of the Demons histogram matching (ITK >= 5.1)
+// - the foreground mask and its padded bounding box (-mask)
+// the pyramid levels are also kept in the result store when it is enabled (keyed by a hash of the fixed image and
+// the pyramid settings), so later shards and reruns with the same fixed image read them instead of smoothing again
+// (the mean squares metric takes the gradients of the moving image, so there is no fixed gradient image to share)
+// everything is computed on first use; safe to use from several subject workers at once
+template < typename TImage >
+class FixedImageCache
+{
+public:
+	typedef TImage ImageType ;
+	typedef typename ImageType::Pointer ImagePointer ;
+	typedef typename ImageType::RegionType RegionType ;
+	static const unsigned int ImageDimension = ImageType::ImageDimension ;
+	typedef std::vector < ImagePointer > LevelListType ;
+	typedef SmoothingPyramidImageFilter < ImageType, ImageType > PyramidType ;
+	typedef MetricSampler < ImageType > SamplerType ;
+	typedef typename SamplerType::IndexListType IndexListType ;
+	typedef itk::HistogramMatchingImageFilter < ImageType, ImageType > MatchingFilterType ;
+	typedef typename MatchingFilterType::HistogramType HistogramType ;
+	typedef ForegroundMask < ImageType > ForegroundMaskType ;
+	typedef typename ForegroundMaskType::MaskImagePointer MaskImagePointer ;
+	typedef typename ForegroundMaskType::MaskSpatialObjectPointer MaskSpatialObjectPointer ;
+
+	explicit FixedImageCache(const ImageType * fixedImage, const ResultStore & store = ResultStore())
+		: m_FixedImage(fixedImage), m_Store(store) {}
+
+	const ImageType * GetFixedImage() const
+	{
+		return m_FixedImage;
+	}
+
+	// hash of the fixed image, e.g. for the result store keys of every subject
+	std::string GetDigest()
+	{
+		std::lock_guard < std::mutex > lock(m_Mutex);
+		return this->GetImageDigest();
+	}
+
+	// the fixed image pyramid for levels, shrinkFactors (empty --> ITK default schedule) and sigmas
+	// (empty --> ITK default smoothing), finest level last
+	LevelListType GetPyramidLevels(unsigned int levels, const std::vector < double > & shrinkFactors, const std::vector < double > & sigmas)
+	{
+		std::stringstream description;
+		description << levels;
+		for (size_t k = 0; k < shrinkFactors.size(); ++k)
+		{
+			description << " s" << shrinkFactors[k];
+		}
+		for (size_t k = 0; k < sigmas.size(); ++k)
+		{
+			description << " g" << sigmas[k];
+		}
+		std::lock_guard < std::mutex > lock(m_Mutex);
+		LevelListType & pyramid = m_Pyramids[description.str()];
+		if (!pyramid.empty())
+		{
+			return pyramid;
+		}
+		std::string key;
+		if (m_Store.IsEnabled())
+		{
+			Hash hash;
+			hash.Add(this->GetImageDigest());
+			hash.Add(description.str());
+			key = hash.GetDigest();
+			if (this->HasStoredLevels(key, levels))
+			{
+				for (unsigned int level = 0; level < levels; ++level)
+				{
+					pyramid.push_back(m_Store.template ReadImage < ImageType >("fixed", this->GetLevelStage(level), key));
+				}
+				std::cout << "read fixed image pyramid from " << m_Store.GetPath("fixed", this->GetLevelStage(0), key, "nrrd") << std::endl;
+				return pyramid;
+			}
+		}
+		TraceStage stage("pyramid", "fixed");
+		typename PyramidType::Pointer pyramidFilter = PyramidType::New();
+		pyramidFilter->SetNumberOfLevels(levels);
+		if (!shrinkFactors.empty())
+		{
+			typename PyramidType::ScheduleType schedule(levels, ImageDimension);
+			for (unsigned int level = 0; level < levels; ++level)
+			{
+				for (unsigned int d = 0; d < ImageDimension; ++d)
+				{
+					schedule[level][d] = static_cast < unsigned int >(shrinkFactors[level]);
+				}
+			}
+			pyramidFilter->SetSchedule(schedule);
+		}
+		pyramidFilter->SetSmoothingSigmas(sigmas);
+		pyramidFilter->SetInput(m_FixedImage);
+		pyramidFilter->UpdateLargestPossibleRegion();
+		for (unsigned int level = 0; level < levels; ++level)
+		{
+			ImagePointer image = pyramidFilter->GetOutput(level);
+			image->DisconnectPipeline();
+			pyramid.push_back(image);
+			if (m_Store.IsEnabled())
+			{
+				m_Store.WriteImage("fixed", this->GetLevelStage(level), key, image.GetPointer());
+			}
+		}
+		return pyramid;
+	}
+
+	// sample indexes of draw (the pyramid level) inside region, as sampler would draw them
+	IndexListType GetSamples(const SamplerType & sampler, const RegionType & region, unsigned int draw)
+	{
+		std::stringstream description;
+		description << sampler.GetDescription() << " " << draw << " " << region;
+		std::lock_guard < std::mutex > lock(m_Mutex);
+		typename std::map < std::string, IndexListType >::iterator it = m_Samples.find(description.str());
+		if (it == m_Samples.end())
+		{
+			it = m_Samples.insert(std::make_pair(description.str(), sampler.Sample(region, draw))).first;
+		}
+		return it->second;
+	}
+
+	// foreground of the fixed image as a metric mask
+	MaskSpatialObjectPointer GetForegroundSpatialObject()
+	{
+		std::lock_guard < std::mutex > lock(m_Mutex);
+		if (m_ForegroundSpatialObject.IsNull())
+		{
+			m_ForegroundSpatialObject = ForegroundMaskType::GetMaskSpatialObject(this->GetForegroundMask());
+		}
+		return m_ForegroundSpatialObject;
+	}
+
+	// bounding box of the foreground of the fixed image grown by padding (mm)
+	RegionType GetForegroundBox(double padding)
+	{
+		std::lock_guard < std::mutex > lock(m_Mutex);
+		typename std::map < double, RegionType >::iterator it = m_ForegroundBoxes.find(padding);
+		if (it == m_ForegroundBoxes.end())
+		{
+			it = m_ForegroundBoxes.insert(std::make_pair(padding, ForegroundMaskType::GetBoundingBox(this->GetForegroundMask(), padding))).first;
+		}
+		return it->second;
+	}
+
+#ifdef ATLAS_REFERENCE_HISTOGRAM
+	// histogram of the fixed image as HistogramMatchingImageFilter builds it for a reference image
+	// (histogramLevels bins, above the mean intensity)
+	HistogramType * GetReferenceHistogram(unsigned int histogramLevels, unsigned int matchPoints)
+	{
+		std::stringstream description;
+		description << histogramLevels << " " << matchPoints;
+		std::lock_guard < std::mutex > lock(m_Mutex);
+		typename HistogramType::Pointer & histogram = m_Histograms[description.str()];
+		if (histogram.IsNull())
+		{
+			TraceStage stage("histogram", "fixed");
+			// match the fixed image to itself once and keep the reference histogram it built
+			typename MatchingFilterType::Pointer matcher = MatchingFilterType::New();
+			matcher->SetInput(m_FixedImage);
+			matcher->SetReferenceImage(m_FixedImage);
+			matcher->SetNumberOfHistogramLevels(histogramLevels);
+			matcher->SetNumberOfMatchPoints(matchPoints);
+			matcher->ThresholdAtMeanIntensityOn();
+			matcher->Update();
+			histogram = const_cast < HistogramType * >(matcher->GetReferenceHistogram());
+		}
+		return histogram.GetPointer();
+	}
+#endif
+
+private:
+	// hash of the fixed image (computed once, the image doesn't change; with the lock held)
+	const std::string & GetImageDigest()
+	{
+		if (m_ImageDigest.empty())
+		{
+			Hash hash;
+			hash.AddImage(m_FixedImage);
+			m_ImageDigest = hash.GetDigest();
+		}
+		return m_ImageDigest;
+	}
+
+	// computed on first use (with the lock held)
+	const typename ForegroundMaskType::MaskImageType * GetForegroundMask()
+	{
+		if (m_ForegroundMask.IsNull())
+		{
+			m_ForegroundMask = ForegroundMaskType::GetMask(m_FixedImage);
+		}
+		return m_ForegroundMask.GetPointer();
+	}
+
+	std::string GetLevelStage(unsigned int level) const
+	{
+		std::stringstream stage;
+		stage << "pyramid" << level;
+		return stage.str();
+	}
+
+	bool HasStoredLevels(const std::string & key, unsigned int levels) const
+	{
+		for (unsigned int level = 0; level < levels; ++level)
+		{
+			if (!m_Store.Has("fixed", this->GetLevelStage(level), key, "nrrd"))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	const ImageType * m_FixedImage ;
+	ResultStore m_Store ;
+	std::mutex m_Mutex ;
+	std::string m_ImageDigest ;
+	std::map < std::string, LevelListType > m_Pyramids ;
+	std::map < std::string, IndexListType > m_Samples ;
+	std::map < std::string, typename HistogramType::Pointer > m_Histograms ;
+	MaskImagePointer m_ForegroundMask ;
+	MaskSpatialObjectPointer m_ForegroundSpatialObject ;
+	std::map < double, RegionType > m_ForegroundBoxes ;
+};
+
+// hash of fixedImage, from cache (computed once per run) if it is the cache's image
+template < typename TImage >
+std::string GetFixedImageDigest(const TImage * fixedImage, FixedImageCache < TImage > * cache)
+{
+	if (cache && cache->GetFixedImage() == fixedImage)
+	{
+		return cache->GetDigest();
+	}
+	Hash hash;
+	hash.AddImage(fixedImage);
+	return hash.GetDigest();
+}
+
+} // end namespace atlas
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef ForegroundMask_h
+#define ForegroundMask_h
+
+#include <algorithm>
+#include <cmath>
+#include "itkImage.h"
+#include "itkOtsuThresholdImageFilter.h"
+#include "itkExtractImageFilter.h"
+#include "itkPasteImageFilter.h"
+#include "itkImageMaskSpatialObject.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "AtlasTrace.h"
+
+namespace atlas
+{
+
+// head (foreground) of a scan: the voxels above the Otsu threshold, most of an MPRAGE volume being background air
+// the registrations crop their images to the padded bounding box of the foreground and evaluate the affine
+// metric only inside the mask, so every iteration visits a fraction of the voxels; the results (transforms
+// are physical, fields are padded with zeros) still apply to the full grids
+template < typename TImage >
+class ForegroundMask
+{
+public:
+	typedef TImage ImageType ;
+	typedef typename ImageType::Pointer ImagePointer ;
+	typedef typename ImageType::RegionType RegionType ;
+	typedef typename ImageType::IndexType IndexType ;
+	typedef typename ImageType::SizeType SizeType ;
+	static const unsigned int ImageDimension = ImageType::ImageDimension ;
+	typedef itk::Image < unsigned char, ImageDimension > MaskImageType ;
+	typedef typename MaskImageType::Pointer MaskImagePointer ;
+	typedef itk::ImageMaskSpatialObject < ImageDimension > MaskSpatialObjectType ;
+	typedef typename MaskSpatialObjectType::Pointer MaskSpatialObjectPointer ;
+
+	// 1 inside the foreground, 0 outside
+	static MaskImagePointer GetMask(const ImageType * image)
+	{
+		TraceStage stage("mask");
+		typedef itk::OtsuThresholdImageFilter < ImageType, MaskImageType > ThresholdFilterType ;
+		typename ThresholdFilterType::Pointer threshold = ThresholdFilterType::New();
+		threshold->SetInput(image);
+		// the filter calls the voxels below the threshold inside
+		threshold->SetInsideValue(0);
+		threshold->SetOutsideValue(1);
+		threshold->Update();
+		MaskImagePointer mask = threshold->GetOutput();
+		mask->DisconnectPipeline();
+		return mask;
+	}
+
+	// the mask for a metric (SetFixedImageMask)
+	static MaskSpatialObjectPointer GetMaskSpatialObject(const MaskImageType * mask)
+	{
+		MaskSpatialObjectPointer spatialObject = MaskSpatialObjectType::New();
+		spatialObject->SetImage(mask);
+#if ITK_VERSION_MAJOR >= 5
+		spatialObject->Update();
+#endif
+		return spatialObject;
+	}
+
+	// drop the indexes (of image) whose points lie outside mask, keeping the order- for metric samples, as the
+	// metric doesn't check its mask at indexes it is given
+	template < typename TIndexList >
+	static void KeepInside(const MaskSpatialObjectType * mask, const ImageType * image, TIndexList & indexes)
+	{
+		size_t kept = 0;
+		for (size_t k = 0; k < indexes.size(); ++k)
+		{
+			typename ImageType::PointType point;
+			image->TransformIndexToPhysicalPoint(indexes[k], point);
+#if ITK_VERSION_MAJOR >= 5
+			if (mask->IsInsideInWorldSpace(point))
+#else
+			if (mask->IsInside(point))
+#endif
+			{
+				indexes[kept++] = indexes[k];
+			}
+		}
+		indexes.resize(kept);
+	}
+
+	// bounding box of the mask grown by padding (mm) on every side, inside the image
+	static RegionType GetBoundingBox(const MaskImageType * mask, double padding)
+	{
+		const RegionType & largest = mask->GetLargestPossibleRegion();
+		IndexType lower = largest.GetUpperIndex();
+		IndexType upper = largest.GetIndex();
+		bool any = false;
+		itk::ImageRegionConstIteratorWithIndex < MaskImageType > it(mask, largest);
+		for (; !it.IsAtEnd(); ++it)
+		{
+			if (it.Get() == 0)
+			{
+				continue;
+			}
+			any = true;
+			const IndexType & index = it.GetIndex();
+			for (unsigned int d = 0; d < ImageDimension; ++d)
+			{
+				lower[d] = std::min(lower[d], index[d]);
+				upper[d] = std::max(upper[d], index[d]);
+			}
+		}
+		if (!any)
+		{
+			return largest;
+		}
+		RegionType box;
+		for (unsigned int d = 0; d < ImageDimension; ++d)
+		{
+			long grow = static_cast < long >(std::ceil(padding / mask->GetSpacing()[d]));
+			box.SetIndex(d, lower[d] - grow);
+			box.SetSize(d, upper[d] - lower[d] + 1 + 2 * grow);
+		}
+		box.Crop(largest);
+		return box;
+	}
+
+	// smallest region holding both boxes
+	static RegionType GetUnion(const RegionType & a, const RegionType & b)
+	{
+		RegionType both;
+		for (unsigned int d = 0; d < ImageDimension; ++d)
+		{
+			long lower = std::min(a.GetIndex(d), b.GetIndex(d));
+			long upper = std::max(a.GetIndex(d) + static_cast < long >(a.GetSize(d)), b.GetIndex(d) + static_cast < long >(b.GetSize(d)));
+			both.SetIndex(d, lower);
+			both.SetSize(d, upper - lower);
+		}
+		return both;
+	}
+
+	// box (a region of the grid of from) on the grid of to, e.g. a pyramid level of from
+	template < typename TFromImage, typename TToImage >
+	static RegionType MapRegion(const TFromImage * from, const RegionType & box, const TToImage * to)
+	{
+		IndexType first = box.GetIndex();
+		IndexType last = box.GetUpperIndex();
+		typename TFromImage::PointType p, q;
+		from->TransformIndexToPhysicalPoint(first, p);
+		from->TransformIndexToPhysicalPoint(last, q);
+		itk::ContinuousIndex < double, ImageDimension > a, b;
+		to->TransformPhysicalPointToContinuousIndex(p, a);
+		to->TransformPhysicalPointToContinuousIndex(q, b);
+		RegionType region;
+		for (unsigned int d = 0; d < ImageDimension; ++d)
+		{
+			long lower = static_cast < long >(std::floor(std::min(a[d], b[d])));
+			long upper = static_cast < long >(std::ceil(std::max(a[d], b[d])));
+			region.SetIndex(d, lower);
+			region.SetSize(d, upper - lower + 1);
+		}
+		region.Crop(to->GetLargestPossibleRegion());
+		return region;
+	}
+
+	// region of image as an image of its own (same physical space and indexes)
+	template < typename TCropImage >
+	static typename TCropImage::Pointer Crop(const TCropImage * image, const RegionType & region)
+	{
+		typedef itk::ExtractImageFilter < TCropImage, TCropImage > ExtractFilterType ;
+		typename ExtractFilterType::Pointer extractor = ExtractFilterType::New();
+		extractor->SetInput(image);
+		extractor->SetExtractionRegion(region);
+		extractor->SetDirectionCollapseToSubmatrix();
+		extractor->Update();
+		typename TCropImage::Pointer cropped = extractor->GetOutput();
+		cropped->DisconnectPipeline();
+		return cropped;
+	}
+
+	// cropped (e.g. a displacement field of a crop) on the grid of reference, zero outside the crop
+	template < typename TPadImage >
+	static typename TPadImage::Pointer Pad(const TPadImage * cropped, const ImageType * reference)
+	{
+		typename TPadImage::Pointer padded = TPadImage::New();
+		padded->CopyInformation(reference);
+		padded->SetRegions(reference->GetLargestPossibleRegion());
+		padded->Allocate();
+		padded->FillBuffer(itk::NumericTraits < typename TPadImage::PixelType >::ZeroValue());
+		typedef itk::PasteImageFilter < TPadImage, TPadImage > PasteFilterType ;
+		typename PasteFilterType::Pointer paster = PasteFilterType::New();
+		paster->SetDestinationImage(padded);
+		paster->SetSourceImage(cropped);
+		paster->SetSourceRegion(cropped->GetLargestPossibleRegion());
+		paster->SetDestinationIndex(cropped->GetLargestPossibleRegion().GetIndex());
+		paster->Update();
+		typename TPadImage::Pointer output = paster->GetOutput();
+		output->DisconnectPipeline();
+		return output;
+	}
+};
+
+} // end namespace atlas
+
+#endif
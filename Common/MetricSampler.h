@@ -0,0 +1,146 @@
+#ifndef MetricSampler_h
+#define MetricSampler_h
+
+#include <cmath>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace atlas
+{
+
+// picks the fixed image voxels at which a metric is evaluated
+// "full"   every voxel of the region (no sampling)
+// "random" uniformly drawn voxels
+// "grid"   stratified: the region is split into equal cells and one randomly jittered voxel is drawn per cell
+// the number of samples is either a count or a fraction of the region; draws are reproducible from the seed
+// (the same seed and draw number always give the same voxels)
+template < typename TImage >
+class MetricSampler
+{
+public:
+	typedef typename TImage::IndexType IndexType ;
+	typedef typename TImage::RegionType RegionType ;
+	typedef std::vector < IndexType > IndexListType ;
+	static const unsigned int ImageDimension = TImage::ImageDimension ;
+
+	MetricSampler() : m_Mode("full"), m_NumberOfSamples(0), m_Fraction(0), m_Seed(0) {}
+
+	void SetMode(const std::string & mode)
+	{
+		m_Mode = mode ;
+	}
+	const std::string & GetMode() const
+	{
+		return m_Mode ;
+	}
+	bool IsSampling() const
+	{
+		return m_Mode != "full" ;
+	}
+	// absolute count wins over the fraction when both are set
+	void SetNumberOfSamples(unsigned long samples)
+	{
+		m_NumberOfSamples = samples ;
+	}
+	void SetFraction(double fraction)
+	{
+		m_Fraction = fraction ;
+	}
+	void SetSeed(unsigned int seed)
+	{
+		m_Seed = seed ;
+	}
+	// mode, sample count/fraction and seed, e.g. "random 0 0.05 0" (identifies the draws)
+	std::string GetDescription() const
+	{
+		std::stringstream description;
+		description << m_Mode << " " << m_NumberOfSamples << " " << m_Fraction << " " << m_Seed;
+		return description.str();
+	}
+
+	unsigned long GetNumberOfSamples(const RegionType & region) const
+	{
+		unsigned long voxels = region.GetNumberOfPixels();
+		unsigned long samples = m_NumberOfSamples;
+		if (samples == 0)
+		{
+			samples = static_cast < unsigned long >(m_Fraction * voxels);
+		}
+		if (samples == 0 || samples > voxels)
+		{
+			samples = voxels;
+		}
+		return samples;
+	}
+
+	// voxels for one draw (e.g. pyramid level or optimizer iteration) inside region
+	IndexListType Sample(const RegionType & region, unsigned int draw) const
+	{
+		std::mt19937 generator(m_Seed + 7919 * draw);
+		unsigned long samples = this->GetNumberOfSamples(region);
+		IndexListType indexes;
+		indexes.reserve(samples);
+		if (m_Mode == "grid")
+		{
+			// cubic cells (in voxels) so that the number of cells is about the number of samples
+			double cell = std::pow(static_cast < double >(region.GetNumberOfPixels()) / samples, 1.0 / ImageDimension);
+			if (cell < 1)
+			{
+				cell = 1;
+			}
+			unsigned long cells[ImageDimension];
+			unsigned long total = 1;
+			for (unsigned int d = 0; d < ImageDimension; ++d)
+			{
+				cells[d] = static_cast < unsigned long >(std::ceil(region.GetSize(d) / cell));
+				total *= cells[d];
+			}
+			std::uniform_real_distribution < double > jitter(0.0, 1.0);
+			for (unsigned long c = 0; c < total; ++c)
+			{
+				unsigned long rest = c;
+				IndexType index;
+				bool inside = true;
+				for (unsigned int d = 0; d < ImageDimension; ++d)
+				{
+					unsigned long cd = rest % cells[d];
+					rest /= cells[d];
+					unsigned long offset = static_cast < unsigned long >((cd + jitter(generator)) * cell);
+					inside = inside && offset < region.GetSize(d);
+					index[d] = region.GetIndex(d) + offset;
+				}
+				if (inside)
+				{
+					indexes.push_back(index);
+				}
+			}
+		} else
+		{
+			std::uniform_int_distribution < unsigned long > pick(0, region.GetNumberOfPixels() - 1);
+			for (unsigned long k = 0; k < samples; ++k)
+			{
+				unsigned long rest = pick(generator);
+				IndexType index;
+				for (unsigned int d = 0; d < ImageDimension; ++d)
+				{
+					index[d] = region.GetIndex(d) + rest % region.GetSize(d);
+					rest /= region.GetSize(d);
+				}
+				indexes.push_back(index);
+			}
+		}
+		return indexes;
+	}
+
+private:
+	std::string m_Mode ;
+	unsigned long m_NumberOfSamples ;
+	double m_Fraction ;
+	unsigned int m_Seed ;
+};
+
+} // end namespace atlas
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef PrefetchReader_h
+#define PrefetchReader_h
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkMacro.h"
+#include "AtlasTrace.h"
+
+namespace atlas
+{
+
+// reads (and decompresses) the upcoming subjects on background threads while the current ones register
+// the files are read in the order given, at most lookAhead images are read ahead of the subjects asking for
+// them (which bounds the memory), and Get hands a subject its image as soon as it is there
+// a file nobody is going to ask for (e.g. a subject another worker claimed) must be Discard-ed, or it keeps
+// its look-ahead slot; a file that is not in the list, or not read yet, is read by the caller itself
+// lookAhead 0 --> no background reading
+template < typename TImage >
+class PrefetchReader
+{
+public:
+	typedef TImage ImageType ;
+	typedef typename ImageType::Pointer ImagePointer ;
+	typedef itk::ImageFileReader < ImageType > ReaderType ;
+
+	PrefetchReader(const std::vector < std::string > & fileNames, unsigned int lookAhead, unsigned int threads = 1)
+		: m_FileNames(fileNames), m_LookAhead(lookAhead), m_Next(0), m_Held(0), m_Done(false)
+	{
+		for (size_t k = 0; k < m_FileNames.size(); ++k)
+		{
+			m_Entries[m_FileNames[k]] = Entry();
+		}
+		if (m_LookAhead == 0)
+		{
+			threads = 0;
+		}
+		for (unsigned int t = 0; t < threads; ++t)
+		{
+			m_Threads.push_back(std::thread(&PrefetchReader::Run, this));
+		}
+	}
+
+	~PrefetchReader()
+	{
+		{
+			std::lock_guard < std::mutex > lock(m_Mutex);
+			m_Done = true;
+		}
+		m_Changed.notify_all();
+		for (size_t t = 0; t < m_Threads.size(); ++t)
+		{
+			m_Threads[t].join();
+		}
+	}
+
+	// the image in fileName (waits for a read in progress); throws itk::ExceptionObject if it can't be read
+	ImagePointer Get(const std::string & fileName, const std::string & subject = "")
+	{
+		std::unique_lock < std::mutex > lock(m_Mutex);
+		typename std::map < std::string, Entry >::iterator it = m_Entries.find(fileName);
+		if (it == m_Entries.end() || it->second.state == Waiting || it->second.state == Taken)
+		{
+			if (it != m_Entries.end())
+			{
+				it->second.state = Taken;
+			}
+			lock.unlock();
+			return Read(fileName, subject.empty() ? fileName : subject);
+		}
+		Entry & entry = it->second;
+		m_Changed.wait(lock, [&entry]() { return entry.state == Ready; });
+		ImagePointer image = entry.image;
+		std::string error = entry.error;
+		entry.image = nullptr;
+		entry.state = Taken;
+		--m_Held;
+		lock.unlock();
+		m_Changed.notify_all();
+		if (image.IsNull())
+		{
+			itkGenericExceptionMacro(<< "could not read " << fileName << ": " << error);
+		}
+		return image;
+	}
+
+	// fileName won't be asked for: don't read it, or drop it once read
+	void Discard(const std::string & fileName)
+	{
+		std::unique_lock < std::mutex > lock(m_Mutex);
+		typename std::map < std::string, Entry >::iterator it = m_Entries.find(fileName);
+		if (it == m_Entries.end())
+		{
+			return;
+		}
+		if (it->second.state == Ready)
+		{
+			it->second.image = nullptr;
+			--m_Held;
+		} else if (it->second.state == Reading)
+		{
+			it->second.discard = true;
+			return;
+		}
+		it->second.state = Taken;
+		lock.unlock();
+		m_Changed.notify_all();
+	}
+
+private:
+	PrefetchReader(const PrefetchReader &);
+	PrefetchReader & operator=(const PrefetchReader &);
+
+	enum State { Waiting, Reading, Ready, Taken };
+	struct Entry
+	{
+		Entry() : state(Waiting), discard(false) {}
+		State state ;
+		bool discard ;
+		ImagePointer image ;
+		std::string error ;
+	};
+
+	static ImagePointer Read(const std::string & fileName, const std::string & subject)
+	{
+		TraceStage stage("read", subject);
+		typename ReaderType::Pointer reader = ReaderType::New();
+		reader->SetFileName(fileName);
+		reader->Update();
+		ImagePointer image = reader->GetOutput();
+		image->DisconnectPipeline();
+		return image;
+	}
+
+	// background reader: the next file still waiting, while fewer than lookAhead images are held
+	void Run()
+	{
+		for (;;)
+		{
+			std::unique_lock < std::mutex > lock(m_Mutex);
+			m_Changed.wait(lock, [this]() { return m_Done || (m_Next < m_FileNames.size() && m_Held < m_LookAhead); });
+			if (m_Done)
+			{
+				return;
+			}
+			std::string fileName = m_FileNames[m_Next++];
+			Entry & entry = m_Entries[fileName];
+			if (entry.state != Waiting)
+			{
+				// asked for or discarded before its turn
+				continue;
+			}
+			entry.state = Reading;
+			++m_Held;
+			lock.unlock();
+
+			ImagePointer image;
+			std::string error;
+			try
+			{
+				image = Read(fileName, fileName);
+			}
+			catch (itk::ExceptionObject & err)
+			{
+				error = err.GetDescription();
+			}
+
+			lock.lock();
+			if (entry.discard)
+			{
+				entry.state = Taken;
+				--m_Held;
+			} else
+			{
+				entry.image = image;
+				entry.error = error;
+				entry.state = Ready;
+			}
+			lock.unlock();
+			m_Changed.notify_all();
+		}
+	}
+
+	std::vector < std::string > m_FileNames ;
+	std::map < std::string, Entry > m_Entries ;
+	unsigned int m_LookAhead ;
+	size_t m_Next ;
+	unsigned int m_Held ;
+	bool m_Done ;
+	std::mutex m_Mutex ;
+	std::condition_variable m_Changed ;
+	std::vector < std::thread > m_Threads ;
+};
+
+} // end namespace atlas
+
+#endif
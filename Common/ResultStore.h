@@ -0,0 +1,211 @@
+#ifndef ResultStore_h
+#define ResultStore_h
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkTransformFileReader.h"
+#include "itkTransformFileWriter.h"
+#include "itkMacro.h"
+#include "itksys/SystemTools.hxx"
+#include "AtlasTrace.h"
+
+namespace atlas
+{
+
+// 64 bit FNV-1a hash of everything a registration result depends on (images and settings)
+class Hash
+{
+public:
+	Hash() : m_Value(14695981039346656037ULL) {}
+
+	void Add(const void * data, size_t bytes)
+	{
+		const unsigned char * p = static_cast < const unsigned char * >(data);
+		for (size_t k = 0; k < bytes; ++k)
+		{
+			m_Value = (m_Value ^ p[k]) * 1099511628211ULL;
+		}
+	}
+	void Add(const std::string & value)
+	{
+		// length first so that "ab" + "c" and "a" + "bc" differ
+		this->Add(static_cast < double >(value.size()));
+		this->Add(value.data(), value.size());
+	}
+	void Add(double value)
+	{
+		this->Add(&value, sizeof(value));
+	}
+
+	// pixels and geometry of an image
+	template < typename TImage >
+	void AddImage(const TImage * image)
+	{
+		const typename TImage::RegionType & region = image->GetBufferedRegion();
+		for (unsigned int d = 0; d < TImage::ImageDimension; ++d)
+		{
+			this->Add(static_cast < double >(region.GetSize(d)));
+			this->Add(image->GetSpacing()[d]);
+			this->Add(image->GetOrigin()[d]);
+			for (unsigned int e = 0; e < TImage::ImageDimension; ++e)
+			{
+				this->Add(image->GetDirection()[d][e]);
+			}
+		}
+		this->Add(image->GetBufferPointer(), region.GetNumberOfPixels() * sizeof(typename TImage::PixelType));
+	}
+
+	// 16 hex digits
+	std::string GetDigest() const
+	{
+		char digest[17];
+		snprintf(digest, sizeof(digest), "%016llx", static_cast < unsigned long long >(m_Value));
+		return digest;
+	}
+
+private:
+	unsigned long long m_Value ;
+};
+
+// per-subject registration results (affine transforms, displacement fields) kept on disk between runs
+// a result is stored under <directory>/<subject>_<stage>_<key>.<extension>, key being the Hash of its inputs,
+// so a rerun finds it only if nothing it depends on changed; <subject>_<stage>.latest names the key of the
+// subject's last stored result, which seeds (warm-starts) the next registration when the inputs did change
+// files are written under a temporary name and renamed, so a crashed run never leaves a partial result behind
+// and rerunning the shard resumes with the subjects it didn't finish
+// an empty directory disables the store
+class ResultStore
+{
+public:
+	explicit ResultStore(const std::string & directory = "") : m_Directory(directory)
+	{
+		if (!m_Directory.empty())
+		{
+			itksys::SystemTools::MakeDirectory(m_Directory);
+		}
+	}
+
+	bool IsEnabled() const
+	{
+		return !m_Directory.empty();
+	}
+
+	std::string GetPath(const std::string & subject, const std::string & stage, const std::string & key, const std::string & extension) const
+	{
+		return m_Directory + "/" + subject + "_" + stage + "_" + key + "." + extension;
+	}
+
+	bool Has(const std::string & subject, const std::string & stage, const std::string & key, const std::string & extension) const
+	{
+		return this->IsEnabled() && itksys::SystemTools::FileExists(this->GetPath(subject, stage, key, extension), true);
+	}
+
+	// key of the subject's last stored result of stage ("" if none)
+	std::string GetLatestKey(const std::string & subject, const std::string & stage) const
+	{
+		std::string key;
+		if (this->IsEnabled())
+		{
+			std::ifstream latest((m_Directory + "/" + subject + "_" + stage + ".latest").c_str());
+			latest >> key;
+		}
+		return key;
+	}
+
+	template < typename TTransform >
+	void WriteTransform(const std::string & subject, const std::string & stage, const std::string & key, const TTransform * transform) const
+	{
+		TraceStage traceStage("store", subject);
+		std::string path = this->GetPath(subject, stage, key, "tfm");
+		std::string temporary = this->GetPath(subject, stage, key + ".partial", "tfm");
+		typedef itk::TransformFileWriter TransformWriterType ;
+		TransformWriterType::Pointer writer = TransformWriterType::New();
+		writer->SetFileName(temporary);
+		writer->SetInput(transform);
+		writer->Update();
+		this->Commit(temporary, path, subject, stage, key);
+	}
+
+	// reads the stored transform into transform (which must be of the stored type)
+	template < typename TTransform >
+	void ReadTransform(const std::string & subject, const std::string & stage, const std::string & key, TTransform * transform) const
+	{
+		TraceStage traceStage("store", subject);
+		std::string path = this->GetPath(subject, stage, key, "tfm");
+		typedef itk::TransformFileReader TransformReaderType ;
+		TransformReaderType::Pointer reader = TransformReaderType::New();
+		reader->SetFileName(path);
+		reader->Update();
+		if (reader->GetTransformList()->empty())
+		{
+			itkGenericExceptionMacro(<< "no transform in " << path);
+		}
+		const TTransform * stored = dynamic_cast < const TTransform * >(reader->GetTransformList()->front().GetPointer());
+		if (stored == nullptr)
+		{
+			itkGenericExceptionMacro(<< path << " holds a " << reader->GetTransformList()->front()->GetNameOfClass()
+				<< ", expected a " << transform->GetNameOfClass());
+		}
+		transform->SetFixedParameters(stored->GetFixedParameters());
+		transform->SetParameters(stored->GetParameters());
+	}
+
+	// images and displacement fields, as uncompressed NRRD
+	template < typename TImage >
+	void WriteImage(const std::string & subject, const std::string & stage, const std::string & key, const TImage * image) const
+	{
+		TraceStage traceStage("store", subject);
+		std::string path = this->GetPath(subject, stage, key, "nrrd");
+		std::string temporary = this->GetPath(subject, stage, key + ".partial", "nrrd");
+		typedef itk::ImageFileWriter < TImage > WriterType ;
+		typename WriterType::Pointer writer = WriterType::New();
+		writer->SetFileName(temporary);
+		writer->SetInput(image);
+		writer->UseCompressionOff();
+		writer->Update();
+		this->Commit(temporary, path, subject, stage, key);
+	}
+
+	template < typename TImage >
+	typename TImage::Pointer ReadImage(const std::string & subject, const std::string & stage, const std::string & key) const
+	{
+		TraceStage traceStage("store", subject);
+		typedef itk::ImageFileReader < TImage > ReaderType ;
+		typename ReaderType::Pointer reader = ReaderType::New();
+		reader->SetFileName(this->GetPath(subject, stage, key, "nrrd"));
+		reader->Update();
+		typename TImage::Pointer image = reader->GetOutput();
+		image->DisconnectPipeline();
+		return image;
+	}
+
+private:
+	// move a finished file into place and make it the subject's latest result of stage
+	void Commit(const std::string & temporary, const std::string & path, const std::string & subject, const std::string & stage, const std::string & key) const
+	{
+		if (std::rename(temporary.c_str(), path.c_str()) != 0)
+		{
+			itkGenericExceptionMacro(<< "could not rename " << temporary << " to " << path);
+		}
+		std::string latest = m_Directory + "/" + subject + "_" + stage + ".latest";
+		{
+			std::ofstream out((latest + ".partial").c_str());
+			out << key << std::endl;
+		}
+		if (std::rename((latest + ".partial").c_str(), latest.c_str()) != 0)
+		{
+			itkGenericExceptionMacro(<< "could not rename " << latest << ".partial to " << latest);
+		}
+	}
+
+	std::string m_Directory ;
+};
+
+} // end namespace atlas
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef SmoothingPyramidImageFilter_h
+#define SmoothingPyramidImageFilter_h
+
+#include <algorithm>
+#include <vector>
+#include "itkMultiResolutionPyramidImageFilter.h"
+#include "itkCastImageFilter.h"
+#include "itkDiscreteGaussianImageFilter.h"
+#include "itkResampleImageFilter.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkIdentityTransform.h"
+
+namespace atlas
+{
+
+// MultiResolutionPyramidImageFilter with user chosen smoothing per level
+// ITK's pyramid always smooths with sigma = shrinkFactor / 2; here each level gets its own
+// gaussian sigma (in voxels of the input image, coarsest level first, 0 = no smoothing)
+// with no sigmas set it behaves exactly like the superclass
+template < typename TInputImage, typename TOutputImage >
+class SmoothingPyramidImageFilter : public itk::MultiResolutionPyramidImageFilter < TInputImage, TOutputImage >
+{
+public:
+	typedef SmoothingPyramidImageFilter Self ;
+	typedef itk::MultiResolutionPyramidImageFilter < TInputImage, TOutputImage > Superclass ;
+	typedef itk::SmartPointer < Self > Pointer ;
+	typedef itk::SmartPointer < const Self > ConstPointer ;
+	itkNewMacro(Self);
+	itkTypeMacro(SmoothingPyramidImageFilter, MultiResolutionPyramidImageFilter);
+
+	typedef typename Superclass::OutputImageType OutputImageType ;
+	typedef typename Superclass::OutputImagePointer OutputImagePointer ;
+	itkStaticConstMacro(ImageDimension, unsigned int, TOutputImage::ImageDimension);
+
+	// one sigma per level; a shorter list repeats its last value
+	void SetSmoothingSigmas(const std::vector < double > & sigmas)
+	{
+		m_SmoothingSigmas = sigmas ;
+		this->Modified();
+	}
+
+	const std::vector < double > & GetSmoothingSigmas() const
+	{
+		return m_SmoothingSigmas ;
+	}
+
+	// levels already computed from the same input, schedule and sigmas (e.g. by FixedImageCache), finest last
+	// the outputs then share their buffers instead of being computed again
+	void SetPrecomputedLevels(const std::vector < OutputImagePointer > & levels)
+	{
+		m_PrecomputedLevels = levels ;
+		this->Modified();
+	}
+
+protected:
+	SmoothingPyramidImageFilter() {}
+
+	// same as the superclass (caster -> smoother -> identity resample onto each level grid)
+	// except for the smoothing variance
+	void GenerateData() override
+	{
+		if (m_PrecomputedLevels.size() == this->GetNumberOfLevels())
+		{
+			for (unsigned int level = 0; level < this->GetNumberOfLevels(); ++level)
+			{
+				this->GraftNthOutput(level, m_PrecomputedLevels[level]);
+			}
+			return;
+		}
+		if (m_SmoothingSigmas.empty())
+		{
+			Superclass::GenerateData();
+			return;
+		}
+		typedef itk::CastImageFilter < TInputImage, OutputImageType > CasterType ;
+		typedef itk::DiscreteGaussianImageFilter < OutputImageType, OutputImageType > SmootherType ;
+		typedef itk::ResampleImageFilter < OutputImageType, OutputImageType > ResamplerType ;
+		typedef itk::LinearInterpolateImageFunction < OutputImageType, double > LinearInterpolatorType ;
+		typedef itk::IdentityTransform < double, ImageDimension > IdentityTransformType ;
+
+		typename CasterType::Pointer caster = CasterType::New();
+		caster->SetInput(this->GetInput());
+
+		for (unsigned int level = 0; level < this->GetNumberOfLevels(); ++level)
+		{
+			this->UpdateProgress(static_cast < float >(level) / static_cast < float >(this->GetNumberOfLevels()));
+
+			OutputImagePointer outputPtr = this->GetOutput(level);
+			outputPtr->SetBufferedRegion(outputPtr->GetRequestedRegion());
+			outputPtr->Allocate();
+
+			double sigma = m_SmoothingSigmas[std::min < size_t >(level, m_SmoothingSigmas.size() - 1)];
+			typename ResamplerType::Pointer resampler = ResamplerType::New();
+			typename LinearInterpolatorType::Pointer interpolator = LinearInterpolatorType::New();
+			typename IdentityTransformType::Pointer identity = IdentityTransformType::New();
+			resampler->SetInterpolator(interpolator);
+			resampler->SetTransform(identity);
+			resampler->SetDefaultPixelValue(0);
+			resampler->SetOutputParametersFromImage(outputPtr);
+			typename SmootherType::Pointer smoother;
+			if (sigma > 0)
+			{
+				smoother = SmootherType::New();
+				smoother->SetUseImageSpacing(false);
+				smoother->SetVariance(sigma * sigma);
+				smoother->SetMaximumError(this->GetMaximumError());
+				smoother->SetInput(caster->GetOutput());
+				resampler->SetInput(smoother->GetOutput());
+			} else
+			{
+				resampler->SetInput(caster->GetOutput());
+			}
+			resampler->GraftOutput(outputPtr);
+			resampler->UpdateLargestPossibleRegion();
+			this->GraftNthOutput(level, resampler->GetOutput());
+		}
+	}
+
+private:
+	std::vector < double > m_SmoothingSigmas ;
+	std::vector < OutputImagePointer > m_PrecomputedLevels ;
+};
+
+} // end namespace atlas
+
+#endif
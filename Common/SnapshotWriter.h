@@ -0,0 +1,121 @@
+#ifndef SnapshotWriter_h
+#define SnapshotWriter_h
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include "itkMacro.h"
+
+namespace atlas
+{
+
+// runs snapshot jobs (warp + write of an intermediate registration result) on one background thread
+// so that observers only pay for copying the data they need; also used for writing per-subject results
+// (compressing .nii.gz is single threaded in ITK, so it overlaps with the next registration instead)
+// at most maximumPending jobs wait at once- Push blocks while the queue is full, which bounds the memory
+// held by queued copies; the destructor finishes every queued job
+class SnapshotWriter
+{
+public:
+	typedef std::function < void() > JobType ;
+
+	explicit SnapshotWriter(unsigned int maximumPending = 2)
+		: m_MaximumPending(maximumPending > 0 ? maximumPending : 1), m_Done(false), m_Busy(false), m_Failures(0)
+	{
+		m_Thread = std::thread(&SnapshotWriter::Run, this);
+	}
+
+	~SnapshotWriter()
+	{
+		{
+			std::lock_guard < std::mutex > lock(m_Mutex);
+			m_Done = true;
+		}
+		m_Changed.notify_all();
+		m_Thread.join();
+	}
+
+	// queue job; safe to call from several registrations at once
+	void Push(const JobType & job)
+	{
+		std::unique_lock < std::mutex > lock(m_Mutex);
+		m_Changed.wait(lock, [this]() { return m_Jobs.size() < m_MaximumPending; });
+		m_Jobs.push_back(job);
+		lock.unlock();
+		m_Changed.notify_all();
+	}
+
+	// wait until every queued job has run
+	void Flush()
+	{
+		std::unique_lock < std::mutex > lock(m_Mutex);
+		m_Changed.wait(lock, [this]() { return m_Jobs.empty() && !m_Busy; });
+	}
+
+	// jobs that threw
+	unsigned int GetNumberOfFailures()
+	{
+		std::lock_guard < std::mutex > lock(m_Mutex);
+		return m_Failures;
+	}
+
+private:
+	SnapshotWriter(const SnapshotWriter &);
+	SnapshotWriter & operator=(const SnapshotWriter &);
+
+	void Run()
+	{
+		for (;;)
+		{
+			std::unique_lock < std::mutex > lock(m_Mutex);
+			m_Changed.wait(lock, [this]() { return m_Done || !m_Jobs.empty(); });
+			if (m_Jobs.empty())
+			{
+				return;
+			}
+			JobType job = m_Jobs.front();
+			m_Jobs.pop_front();
+			m_Busy = true;
+			lock.unlock();
+			m_Changed.notify_all();
+			// a failed write is reported (and counted) but doesn't stop the registration
+			bool failed = true;
+			try
+			{
+				job();
+				failed = false;
+			}
+			catch (itk::ExceptionObject & err)
+			{
+				std::cerr << "Exception caught writing in the background" << std::endl;
+				std::cerr << err << std::endl;
+			}
+			catch (std::exception & err)
+			{
+				std::cerr << "Exception caught writing in the background: " << err.what() << std::endl;
+			}
+			lock.lock();
+			m_Busy = false;
+			m_Failures += failed ? 1 : 0;
+			lock.unlock();
+			m_Changed.notify_all();
+		}
+	}
+
+	unsigned int m_MaximumPending ;
+	bool m_Done ;
+	bool m_Busy ;
+	unsigned int m_Failures ;
+	std::deque < JobType > m_Jobs ;
+	std::mutex m_Mutex ;
+	std::condition_variable m_Changed ;
+	std::thread m_Thread ;
+};
+
+} // end namespace atlas
+
+#endif
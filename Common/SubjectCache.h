@@ -0,0 +1,138 @@
+#ifndef SubjectCache_h
+#define SubjectCache_h
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkCastImageFilter.h"
+#include "itkMacro.h"
+#include "AtlasTrace.h"
+
+namespace atlas
+{
+
+// the cohort held in memory, keyed by subject ID, so a multi-pass atlas build reads and
+// decompresses every volume once instead of once per pass
+// compact mode keeps the volumes as float (half the memory of double) and casts a subject back to
+// the pipeline precision when it is fetched; with float pipelines both modes store the same images
+template < typename TImage >
+class SubjectCache
+{
+public:
+	typedef TImage ImageType ;
+	typedef typename ImageType::ConstPointer ImageConstPointer ;
+	typedef itk::Image < float, ImageType::ImageDimension > CompactImageType ;
+
+	SubjectCache() : m_Compact(false) {}
+
+	// set before the first Load
+	void SetCompact(bool compact)
+	{
+		m_Compact = compact && !std::is_same < typename ImageType::PixelType, float >::value ;
+	}
+	bool GetCompact() const
+	{
+		return m_Compact ;
+	}
+
+	// read filename and keep it as subject; safe to call from several subject workers at once
+	void Load(const std::string & subject, const std::string & filename)
+	{
+		TraceStage stage("read", subject);
+		if (m_Compact)
+		{
+			typename CompactImageType::Pointer image = ReadImage < CompactImageType >(filename);
+			std::lock_guard < std::mutex > lock(m_Mutex);
+			m_CompactImages[subject] = image;
+		} else
+		{
+			typename ImageType::Pointer image = ReadImage < ImageType >(filename);
+			std::lock_guard < std::mutex > lock(m_Mutex);
+			m_Images[subject] = image;
+		}
+	}
+
+	bool Has(const std::string & subject) const
+	{
+		std::lock_guard < std::mutex > lock(m_Mutex);
+		return m_Images.count(subject) > 0 || m_CompactImages.count(subject) > 0;
+	}
+
+	// the cached subject at pipeline precision- shared and read-only unless the cache is compact,
+	// in which case it is a fresh copy the caller can release once done
+	ImageConstPointer Get(const std::string & subject) const
+	{
+		std::unique_lock < std::mutex > lock(m_Mutex);
+		if (!m_Compact)
+		{
+			typename std::map < std::string, typename ImageType::Pointer >::const_iterator it = m_Images.find(subject);
+			if (it == m_Images.end())
+			{
+				itkGenericExceptionMacro(<< "subject " << subject << " is not cached");
+			}
+			return it->second.GetPointer();
+		}
+		typename std::map < std::string, typename CompactImageType::Pointer >::const_iterator it = m_CompactImages.find(subject);
+		if (it == m_CompactImages.end())
+		{
+			itkGenericExceptionMacro(<< "subject " << subject << " is not cached");
+		}
+		typename CompactImageType::ConstPointer compact = it->second.GetPointer();
+		lock.unlock();
+
+		typedef itk::CastImageFilter < CompactImageType, ImageType > CastFilterType ;
+		typename CastFilterType::Pointer caster = CastFilterType::New();
+		caster->SetInput(compact);
+		caster->Update();
+		typename ImageType::Pointer image = caster->GetOutput();
+		image->DisconnectPipeline();
+		return image.GetPointer();
+	}
+
+	unsigned int GetNumberOfSubjects() const
+	{
+		std::lock_guard < std::mutex > lock(m_Mutex);
+		return static_cast < unsigned int >(m_Images.size() + m_CompactImages.size());
+	}
+
+	// bytes held by the cached pixel buffers
+	size_t GetMemorySize() const
+	{
+		std::lock_guard < std::mutex > lock(m_Mutex);
+		size_t bytes = 0;
+		for (typename std::map < std::string, typename ImageType::Pointer >::const_iterator it = m_Images.begin(); it != m_Images.end(); ++it)
+		{
+			bytes += it->second->GetBufferedRegion().GetNumberOfPixels() * sizeof(typename ImageType::PixelType);
+		}
+		for (typename std::map < std::string, typename CompactImageType::Pointer >::const_iterator it = m_CompactImages.begin(); it != m_CompactImages.end(); ++it)
+		{
+			bytes += it->second->GetBufferedRegion().GetNumberOfPixels() * sizeof(float);
+		}
+		return bytes;
+	}
+
+private:
+	template < typename TReadImage >
+	static typename TReadImage::Pointer ReadImage(const std::string & filename)
+	{
+		typedef itk::ImageFileReader < TReadImage > ReaderType ;
+		typename ReaderType::Pointer reader = ReaderType::New();
+		reader->SetFileName(filename);
+		reader->Update();
+		typename TReadImage::Pointer image = reader->GetOutput();
+		image->DisconnectPipeline();
+		return image;
+	}
+
+	bool m_Compact ;
+	std::map < std::string, typename ImageType::Pointer > m_Images ;
+	std::map < std::string, typename CompactImageType::Pointer > m_CompactImages ;
+	mutable std::mutex m_Mutex ;
+};
+
+} // end namespace atlas
+
+#endif
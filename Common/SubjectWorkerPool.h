@@ -0,0 +1,123 @@
+#ifndef SubjectWorkerPool_h
+#define SubjectWorkerPool_h
+
+#include <atomic>
+#include <exception>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "itkMacro.h"
+#include "itkVersion.h"
+#if ITK_VERSION_MAJOR >= 5
+#include "itkMultiThreaderBase.h"
+#else
+#include "itkMultiThreader.h"
+#endif
+
+namespace atlas
+{
+
+// number of threads every ITK filter uses from now on (per running subject)
+inline void SetNumberOfITKThreads(unsigned int threads)
+{
+	if (threads == 0)
+	{
+		return;
+	}
+#if ITK_VERSION_MAJOR >= 5
+	itk::MultiThreaderBase::SetGlobalDefaultNumberOfThreads(threads);
+#else
+	itk::MultiThreader::SetGlobalDefaultNumberOfThreads(threads);
+#endif
+}
+
+// split the cores of the machine between subject-level jobs and ITK threads per job
+// jobs = 0 --> one job; threads = 0 --> cores / jobs (at least 1)
+inline unsigned int ITKThreadsPerJob(unsigned int jobs, unsigned int threads)
+{
+	if (threads > 0)
+	{
+		return threads;
+	}
+	unsigned int cores = std::thread::hardware_concurrency();
+	if (jobs == 0 || cores == 0)
+	{
+		return cores;
+	}
+	return cores / jobs > 0 ? cores / jobs : 1;
+}
+
+// a new image object sharing the pixel buffer of image (a graft), for the filters of one worker
+// every Update sets requested regions and other pipeline state on the filter inputs, so an image object must not be
+// the input of filters running on several threads at once; the workers share the (read-only) buffer through grafts
+template < typename TImage >
+typename TImage::Pointer GraftImage(const TImage * image)
+{
+	typename TImage::Pointer graft = TImage::New();
+	graft->Graft(image);
+	return graft;
+}
+
+// run registerSubject(subject) for every subject on a pool of jobs threads
+// workers pull the next subject from a shared counter, so a slow subject doesn't hold up the others
+// returns false if any subject failed (the exception is printed and the remaining subjects still run)
+template < typename TFunction >
+bool RunSubjects(const std::vector < int > & subjects, unsigned int jobs, TFunction registerSubject)
+{
+	std::atomic < size_t > next(0);
+	std::atomic < bool > ok(true);
+	if (jobs == 0)
+	{
+		jobs = 1;
+	}
+	if (jobs > subjects.size())
+	{
+		jobs = static_cast < unsigned int >(subjects.size());
+	}
+
+	auto worker = [&]()
+	{
+		for (size_t k = next++; k < subjects.size(); k = next++)
+		{
+			try
+			{
+				if (!registerSubject(subjects[k]))
+				{
+					ok = false;
+				}
+			}
+			catch (itk::ExceptionObject & err)
+			{
+				std::cerr << "Exception caught for subject " << subjects[k] << std::endl;
+				std::cerr << err << std::endl;
+				ok = false;
+			}
+			catch (std::exception & err)
+			{
+				std::cerr << "Exception caught for subject " << subjects[k] << ": " << err.what() << std::endl;
+				ok = false;
+			}
+		}
+	};
+
+	if (jobs <= 1)
+	{
+		// no extra thread needed
+		worker();
+		return ok;
+	}
+	std::vector < std::thread > pool;
+	for (unsigned int t = 0; t < jobs; ++t)
+	{
+		pool.push_back(std::thread(worker));
+	}
+	for (unsigned int t = 0; t < pool.size(); ++t)
+	{
+		pool[t].join();
+	}
+	return ok;
+}
+
+} // end namespace atlas
+
+#endif
@@ -0,0 +1,285 @@
+#ifndef WorkQueue_h
+#define WorkQueue_h
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "itkMacro.h"
+#include "itksys/Directory.hxx"
+#include "itksys/SystemTools.hxx"
+
+namespace atlas
+{
+
+// subjects shared between worker processes through a directory (local or shared filesystem, no server)
+// every worker is started with the same subject range and -queue=dir:
+// - a worker claims a subject by creating <dir>/<subject>.claim with O_EXCL, so each subject is registered
+//   exactly once and fast workers simply claim more subjects (dynamic load balancing)
+// - once a worker runs out of subjects its partial sum joins a tree reduction: a sum that has been merged level times
+//   takes one ready shard of the same level (atomic rename), merges it and goes up a level, until there is none;
+//   then it either holds all subjects (and writes the template) or is published as a ready shard of its level
+//   for a later finisher to pair with- so every image is read and rewritten about log2(workers) times rather than
+//   once per finishing worker
+// shard names carry the image count and level (<kind>_ready_<count>_<level>_<worker>.nrrd), which is how workers
+// see that everything has been published; the last one to publish then takes the few shards left unpaired (at
+// most one per level, unless two workers published at one level at once) and finishes, so the template is written
+// as soon as the last subject is done
+// a subject that fails is recorded as <dir>/<subject>.failed and counts as published (its images must not be in the
+// sums: the subjects add them only once every stage succeeded): the workers still publish what they registered, and
+// the last one reports the failures (leaving the ready shards in place) instead of waiting forever
+// use a fresh directory per run- a worker that dies after claiming leaves its subjects unaccounted for
+// an empty directory disables the queue (every subject is this worker's)
+class WorkQueue
+{
+public:
+	explicit WorkQueue(const std::string & directory = "") : m_Directory(directory)
+	{
+		if (!m_Directory.empty())
+		{
+			itksys::SystemTools::MakeDirectory(m_Directory);
+		}
+		char host[256] = "host";
+		gethostname(host, sizeof(host) - 1);
+		std::stringstream name;
+		name << host << "-" << getpid();
+		m_WorkerName = name.str();
+	}
+
+	const std::string & GetWorkerName() const
+	{
+		return m_WorkerName;
+	}
+
+	bool IsEnabled() const
+	{
+		return !m_Directory.empty();
+	}
+
+	// true if this worker got subject (nobody else will register it)
+	bool Claim(const std::string & subject) const
+	{
+		return !this->IsEnabled() || this->CreateExclusive(m_Directory + "/" + subject + ".claim");
+	}
+
+	// runs registerSubject() for a subject this worker claimed; if it fails (returns false or throws) the subject
+	// is recorded as failed, so the reduction still completes and the last worker reports it
+	template < typename TFunction >
+	bool Run(const std::string & subject, TFunction registerSubject) const
+	{
+		bool ok = false;
+		try
+		{
+			ok = registerSubject();
+		}
+		catch (...)
+		{
+			this->Fail(subject);
+			throw;
+		}
+		if (!ok)
+		{
+			this->Fail(subject);
+		}
+		return ok;
+	}
+
+	// subjects any worker recorded as failed
+	bool HasFailures() const
+	{
+		return this->IsEnabled() && !this->ListFailed().empty();
+	}
+
+	// combine the accumulator with the other workers' sums of kind (see above)
+	// returns true if the accumulator now holds all total subjects- this worker then writes the template
+	// false otherwise, also for the last worker if subjects failed (it reports them, see HasFailures)
+	template < typename TAccumulator >
+	bool Reduce(TAccumulator & accumulator, const std::string & kind, unsigned int total) const
+	{
+		// a worker that got no subjects stays out of the reduction- this way whoever takes shards still holds
+		// unpublished images, so the ready count can only reach total once nobody is merging any more
+		// (a worker with nothing but failed subjects still checks, its failure may be the last one to come in)
+		if (accumulator.GetCount() > 0)
+		{
+			// pair up with shards of the same level while there are any
+			unsigned int level = 0;
+			while (this->TakeLevel(accumulator, kind, level))
+			{
+				++level;
+			}
+			if (accumulator.GetCount() >= total)
+			{
+				return true;
+			}
+			// publish the merged sum
+			std::stringstream ready;
+			ready << m_Directory << "/" << kind << "_ready_" << accumulator.GetCount() << "_" << level << "_" << m_WorkerName << ".nrrd";
+			std::string partial = m_Directory + "/" + kind + "_partial_" + m_WorkerName + ".nrrd";
+			accumulator.WriteShard(partial, kind);
+			if (std::rename(partial.c_str(), ready.str().c_str()) != 0)
+			{
+				itkGenericExceptionMacro(<< "could not rename " << partial << " to " << ready.str());
+			}
+			std::cout << m_WorkerName << " published " << accumulator.GetCount() << " " << kind << " images" << std::endl;
+		} else if (this->ListFailed().empty())
+		{
+			return false;
+		}
+		// still running workers pair up with what is published; if everything is published (or failed), one
+		// worker finishes
+		std::vector < std::string > failed = this->ListFailed();
+		if (this->CountReady(kind) + failed.size() < total || !this->CreateExclusive(m_Directory + "/" + kind + ".final"))
+		{
+			return false;
+		}
+		if (!failed.empty())
+		{
+			std::cerr << failed.size() << " subjects failed, no " << kind << " template written (the registered images are in the " << kind << "_ready_ shards of " << m_Directory << "):";
+			for (size_t k = 0; k < failed.size(); ++k)
+			{
+				std::cerr << " " << failed[k];
+			}
+			std::cerr << std::endl;
+			return false;
+		}
+		TAccumulator complete;
+		this->TakeReady(complete, kind);
+		if (complete.GetCount() < total)
+		{
+			itkGenericExceptionMacro(<< "only " << complete.GetCount() << " of " << total << " " << kind << " images in " << m_Directory);
+		}
+		accumulator.Swap(complete);
+		return true;
+	}
+
+private:
+	void Fail(const std::string & subject) const
+	{
+		if (this->IsEnabled())
+		{
+			this->CreateExclusive(m_Directory + "/" + subject + ".failed");
+		}
+	}
+
+	// subjects with a .failed marker
+	std::vector < std::string > ListFailed() const
+	{
+		std::vector < std::string > subjects;
+		itksys::Directory directory;
+		directory.Load(m_Directory);
+		std::string suffix = ".failed";
+		for (unsigned long k = 0; k < directory.GetNumberOfFiles(); ++k)
+		{
+			std::string name = directory.GetFile(k);
+			if (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+			{
+				subjects.push_back(name.substr(0, name.size() - suffix.size()));
+			}
+		}
+		return subjects;
+	}
+
+	bool CreateExclusive(const std::string & path) const
+	{
+		int fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+		if (fd < 0)
+		{
+			if (errno != EEXIST)
+			{
+				itkGenericExceptionMacro(<< "could not create " << path);
+			}
+			return false;
+		}
+		std::string owner = m_WorkerName + "\n";
+		ssize_t written = write(fd, owner.c_str(), owner.size());
+		(void) written;
+		close(fd);
+		return true;
+	}
+
+	// ready shards of kind
+	std::vector < std::string > ListReady(const std::string & kind) const
+	{
+		std::vector < std::string > names;
+		itksys::Directory directory;
+		directory.Load(m_Directory);
+		std::string prefix = kind + "_ready_";
+		for (unsigned long k = 0; k < directory.GetNumberOfFiles(); ++k)
+		{
+			std::string name = directory.GetFile(k);
+			if (name.compare(0, prefix.size(), prefix) == 0)
+			{
+				names.push_back(name);
+			}
+		}
+		return names;
+	}
+
+	// images in the ready shards of kind (from their names)
+	unsigned int CountReady(const std::string & kind) const
+	{
+		std::vector < std::string > names = this->ListReady(kind);
+		unsigned int count = 0;
+		for (size_t k = 0; k < names.size(); ++k)
+		{
+			count += atoi(names[k].c_str() + kind.size() + 7);
+		}
+		return count;
+	}
+
+	// merge one ready shard of kind at level another worker hasn't taken first; false if there was none
+	template < typename TAccumulator >
+	bool TakeLevel(TAccumulator & accumulator, const std::string & kind, unsigned int level) const
+	{
+		std::vector < std::string > names = this->ListReady(kind);
+		for (size_t k = 0; k < names.size(); ++k)
+		{
+			unsigned int count = 0;
+			unsigned int shardLevel = 0;
+			if (sscanf(names[k].c_str() + kind.size() + 7, "%u_%u", &count, &shardLevel) != 2 || shardLevel != level)
+			{
+				continue;
+			}
+			std::string taken = m_Directory + "/" + kind + "_taken_" + names[k];
+			if (std::rename((m_Directory + "/" + names[k]).c_str(), taken.c_str()) != 0)
+			{
+				continue;
+			}
+			accumulator.MergeShard(taken, kind);
+			std::remove(taken.c_str());
+			std::cout << m_WorkerName << " merged " << names[k] << std::endl;
+			return true;
+		}
+		return false;
+	}
+
+	// merge every ready shard of kind another worker hasn't taken first
+	template < typename TAccumulator >
+	void TakeReady(TAccumulator & accumulator, const std::string & kind) const
+	{
+		std::vector < std::string > names = this->ListReady(kind);
+		for (size_t k = 0; k < names.size(); ++k)
+		{
+			std::string taken = m_Directory + "/" + kind + "_taken_" + names[k];
+			if (std::rename((m_Directory + "/" + names[k]).c_str(), taken.c_str()) != 0)
+			{
+				continue;
+			}
+			accumulator.MergeShard(taken, kind);
+			std::remove(taken.c_str());
+			std::cout << m_WorkerName << " merged " << names[k] << std::endl;
+		}
+	}
+
+	std::string m_Directory ;
+	std::string m_WorkerName ;
+};
+
+} // end namespace atlas
+
+#endif
@@ -0,0 +1,389 @@
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+#include "itkImage.h"
+#include "itkImportImageFilter.h"
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkVector.h"
+#include "itkDivideImageFilter.h"
+#include "AtlasTypes.h"
+#include "AtlasOptions.h"
+#include "AtlasAccumulator.h"
+#include "AffineRegistration.h"
+#include "DemonsRegistration.h"
+#include "FixedImageCache.h"
+#include "ResultStore.h"
+#include "SubjectWorkerPool.h"
+#include "AtlasTrace.h"
+
+// the double build is atlas_engine, the float build (ATLAS_PIXEL_TYPE=float) atlas_engine_float
+#ifndef ATLAS_PYTHON_MODULE
+#define ATLAS_PYTHON_MODULE atlas_engine
+#endif
+
+namespace py = pybind11;
+
+const unsigned int nDims = 3;
+
+// set up types
+typedef atlas::PixelType PixelType ;
+typedef itk::Image < PixelType, nDims > ImageType ;
+typedef itk::Image < atlas::SumPixelType, nDims > SumImageType ;
+typedef itk::ImportImageFilter < PixelType, nDims > ImportFilterType ;
+typedef itk::ImageFileReader < ImageType > ImageReaderType ;
+typedef itk::ImageFileWriter < ImageType > ImageWriterType ;
+typedef itk::Vector < atlas::FieldComponentType, nDims > VectorPixelType ;
+typedef itk::Image < VectorPixelType, nDims > DisplacementFieldType ;
+typedef atlas::AffineRegistration < ImageType > AffineRegistrationType ;
+typedef atlas::DemonsRegistration < ImageType, DisplacementFieldType > DemonsRegistrationType ;
+typedef atlas::FixedImageCache < ImageType > FixedImageCacheType ;
+typedef atlas::Accumulator < ImageType, SumImageType > AccumulatorType ;
+typedef itk::DivideImageFilter < SumImageType, SumImageType, ImageType > DivideFilterType ;
+typedef py::array_t < PixelType, py::array::c_style | py::array::forcecast > PixelArrayType ;
+
+// an ITK image seen from Python
+// arrays are indexed [z, y, x] (C order, x fastest- the ITK buffer layout); spacing, origin and direction
+// are in ITK (x, y, z) order, the direction matrix row-major
+// an image made from an array uses the array's buffer (no copy; owner keeps the array alive), and .array of
+// any image is a view of its ITK buffer (no copy; the view keeps the image alive)
+struct PythonImage
+{
+	ImageType::Pointer image ;
+	py::object owner ;
+};
+
+// PythonImage viewing array
+// a C-contiguous array of PixelType is used in place, anything else (another dtype, a strided view) is converted once
+PythonImage ImportImage(PixelArrayType array, const std::vector < double > & spacing, const std::vector < double > & origin,
+	const std::vector < double > & direction)
+{
+	if (array.ndim() != nDims)
+	{
+		throw std::invalid_argument("expected a 3-d array indexed [z, y, x]");
+	}
+	if (spacing.size() != nDims || origin.size() != nDims || direction.size() != nDims * nDims)
+	{
+		throw std::invalid_argument("expected 3 spacings, 3 origin coordinates and 9 direction cosines");
+	}
+	ImportFilterType::SizeType size;
+	ImportFilterType::IndexType start;
+	double spacingValues[nDims], originValues[nDims];
+	ImportFilterType::DirectionType directionMatrix;
+	for (unsigned int d = 0; d < nDims; ++d)
+	{
+		size[d] = array.shape(nDims - 1 - d);
+		start[d] = 0;
+		spacingValues[d] = spacing[d];
+		originValues[d] = origin[d];
+		for (unsigned int e = 0; e < nDims; ++e)
+		{
+			directionMatrix[d][e] = direction[d * nDims + e];
+		}
+	}
+	ImportFilterType::RegionType region;
+	region.SetIndex(start);
+	region.SetSize(size);
+	ImportFilterType::Pointer importer = ImportFilterType::New();
+	importer->SetRegion(region);
+	importer->SetSpacing(spacingValues);
+	importer->SetOrigin(originValues);
+	importer->SetDirection(directionMatrix);
+	// the registrations only read their inputs- the buffer stays the array's (false: ITK doesn't free it)
+	importer->SetImportPointer(const_cast < PixelType * >(array.data()), array.size(), false);
+	importer->Update();
+	PythonImage result;
+	result.image = importer->GetOutput();
+	result.image->DisconnectPipeline();
+	result.owner = array;
+	return result;
+}
+
+PythonImage WrapImage(ImageType * image)
+{
+	PythonImage result;
+	result.image = image;
+	return result;
+}
+
+// [z, y, x, components] view of the buffer of image, kept alive by base
+template < typename TImage, typename TComponent >
+py::array ViewBuffer(TImage * image, TComponent * buffer, unsigned int components, py::handle base)
+{
+	typename TImage::SizeType size = image->GetBufferedRegion().GetSize();
+	std::vector < py::ssize_t > shape, strides;
+	py::ssize_t stride = sizeof(TComponent) * components;
+	for (unsigned int d = 0; d < nDims; ++d)
+	{
+		shape.insert(shape.begin(), size[d]);
+		strides.insert(strides.begin(), stride);
+		stride *= size[d];
+	}
+	if (components > 1)
+	{
+		shape.push_back(components);
+		strides.push_back(sizeof(TComponent));
+	}
+	return py::array(py::dtype::of < TComponent >(), shape, strides, buffer, base);
+}
+
+// view of an image no Python object holds, e.g. a displacement field or the running sum: the capsule owns a reference
+template < typename TImage, typename TComponent >
+py::array ViewOwnedBuffer(TImage * image, TComponent * buffer, unsigned int components)
+{
+	typename TImage::Pointer * reference = new typename TImage::Pointer(image);
+	py::capsule owner(reference, [](void * p) { delete static_cast < typename TImage::Pointer * >(p); });
+	return ViewBuffer(image, buffer, components, owner);
+}
+
+std::vector < double > GetSpacing(const PythonImage & image)
+{
+	const ImageType::SpacingType & spacing = image.image->GetSpacing();
+	return std::vector < double >(spacing.Begin(), spacing.End());
+}
+
+std::vector < double > GetOrigin(const PythonImage & image)
+{
+	const ImageType::PointType & origin = image.image->GetOrigin();
+	return std::vector < double >(origin.Begin(), origin.End());
+}
+
+std::vector < double > GetDirection(const PythonImage & image)
+{
+	std::vector < double > direction;
+	for (unsigned int d = 0; d < nDims; ++d)
+	{
+		for (unsigned int e = 0; e < nDims; ++e)
+		{
+			direction.push_back(image.image->GetDirection()[d][e]);
+		}
+	}
+	return direction;
+}
+
+// keyword arguments as command line options: register_affine(..., shrink=[4, 2, 1], mask=1) is -shrink=4,2,1 -mask=1
+atlas::Options GetOptions(const py::kwargs & kwargs)
+{
+	atlas::Options options;
+	for (auto item : kwargs)
+	{
+		std::string value;
+		if (py::isinstance < py::list >(item.second) || py::isinstance < py::tuple >(item.second))
+		{
+			for (auto element : item.second)
+			{
+				value += (value.empty() ? "" : ",") + std::string(py::str(element));
+			}
+		} else if (py::isinstance < py::bool_ >(item.second))
+		{
+			// mask=True is -mask=1
+			value = item.second.cast < bool >() ? "1" : "0";
+		} else
+		{
+			value = py::str(item.second);
+		}
+		options.Set(py::str(item.first), value);
+	}
+	return options;
+}
+
+void CheckSubject(const atlas::ResultStore & store, const std::string & subject)
+{
+	if (store.IsEnabled() && subject.empty())
+	{
+		throw std::invalid_argument("a store needs the subject the results are stored under");
+	}
+}
+
+void CheckCache(const FixedImageCacheType * cache, const PythonImage & fixed)
+{
+	if (cache && cache->GetFixedImage() != fixed.image.GetPointer())
+	{
+		throw std::invalid_argument("the cache belongs to another fixed image");
+	}
+}
+
+// moving affinely registered to fixed: (moving resampled onto the fixed grid, transform parameters, fixed parameters)
+py::tuple RegisterAffine(const PythonImage & fixed, const PythonImage & moving, const std::string & subject, const std::string & storeDirectory,
+	FixedImageCacheType * cache, const py::kwargs & kwargs)
+{
+	atlas::AffineSettings < ImageType > settings;
+	if (!atlas::ReadAffineSettings(GetOptions(kwargs), settings))
+	{
+		throw std::invalid_argument("bad affine options (see README)");
+	}
+	settings.observer = false;
+	atlas::ResultStore store(storeDirectory);
+	CheckSubject(store, subject);
+	CheckCache(cache, fixed);
+	AffineRegistrationType::AffineTransformType::Pointer transform;
+	ImageType::Pointer resampled;
+	{
+		// only ITK objects from here on- other Python threads run meanwhile
+		py::gil_scoped_release release;
+		transform = atlas::RegisterAffine(store, subject, fixed.image.GetPointer(), moving.image.GetPointer(), settings, cache);
+		resampled = AffineRegistrationType::Resample(moving.image, transform, fixed.image, subject);
+	}
+	const itk::OptimizerParameters < double > & parameters = transform->GetParameters();
+	const itk::OptimizerParameters < double > & fixedParameters = transform->GetFixedParameters();
+	return py::make_tuple(WrapImage(resampled),
+		std::vector < double >(parameters.begin(), parameters.end()),
+		std::vector < double >(fixedParameters.begin(), fixedParameters.end()));
+}
+
+// moving (already on the fixed grid, e.g. affinely registered) deformably registered to fixed: the warped image,
+// and with returnField also the displacement field as a [z, y, x, 3] array (on the fixed grid shrunk by fieldShrink)
+py::object RegisterDemons(const PythonImage & fixed, const PythonImage & moving, const std::string & subject, const std::string & storeDirectory,
+	FixedImageCacheType * cache, bool returnField, const py::kwargs & kwargs)
+{
+	atlas::DemonsSettings settings;
+	atlas::ReadDemonsSettings(GetOptions(kwargs), settings);
+	settings.observe = false;
+	atlas::ResultStore store(storeDirectory);
+	CheckSubject(store, subject);
+	CheckCache(cache, fixed);
+	if (returnField && store.IsEnabled())
+	{
+		throw std::invalid_argument("the field of a stored registration is in the store, don't ask for it too");
+	}
+	ImageType::Pointer warped;
+	DisplacementFieldType::Pointer field;
+	{
+		py::gil_scoped_release release;
+		if (returnField)
+		{
+			DemonsRegistrationType registration(fixed.image, settings);
+			registration.SetSubject(subject);
+			registration.SetFixedImageCache(cache);
+			registration.Update(moving.image);
+			warped = registration.GetOutput();
+			field = registration.GetDisplacementField();
+		} else
+		{
+			warped = atlas::RegisterDemons < ImageType, DisplacementFieldType >(store, subject, fixed.image.GetPointer(), moving.image.GetPointer(), settings, cache);
+		}
+	}
+	if (!returnField)
+	{
+		return py::cast(WrapImage(warped));
+	}
+	py::array fieldArray = ViewOwnedBuffer(field.GetPointer(), field->GetBufferPointer()->GetDataPointer(), nDims);
+	return py::make_tuple(WrapImage(warped), fieldArray);
+}
+
+PythonImage ReadImage(const std::string & filename)
+{
+	py::gil_scoped_release release;
+	atlas::TraceStage stage("read", filename);
+	ImageReaderType::Pointer reader = ImageReaderType::New();
+	reader->SetFileName(filename);
+	reader->Update();
+	ImageType::Pointer image = reader->GetOutput();
+	image->DisconnectPipeline();
+	return WrapImage(image);
+}
+
+void WriteImage(const PythonImage & image, const std::string & filename)
+{
+	py::gil_scoped_release release;
+	atlas::TraceStage stage("write", filename);
+	ImageWriterType::Pointer writer = ImageWriterType::New();
+	writer->SetFileName(filename);
+	writer->SetInput(image.image);
+	writer->Update();
+}
+
+// the average of the accumulated images
+PythonImage GetMean(const AccumulatorType & accumulator)
+{
+	if (accumulator.GetCount() == 0)
+	{
+		throw std::runtime_error("nothing accumulated");
+	}
+	py::gil_scoped_release release;
+	DivideFilterType::Pointer divFilter = DivideFilterType::New();
+	divFilter->SetInput(accumulator.GetSum());
+	divFilter->SetConstant(accumulator.GetCount());
+	divFilter->Update();
+	ImageType::Pointer mean = divFilter->GetOutput();
+	mean->DisconnectPipeline();
+	return WrapImage(mean);
+}
+
+PYBIND11_MODULE(ATLAS_PYTHON_MODULE, m)
+{
+	m.doc() = "affine and Demons registration and template accumulation of the atlas tools, on NumPy arrays";
+	m.attr("pixel_type") = py::dtype::of < PixelType >();
+
+	py::class_ < PythonImage >(m, "Image")
+		.def(py::init([](PixelArrayType array, std::vector < double > spacing, std::vector < double > origin, std::vector < double > direction)
+			{
+				return ImportImage(array, spacing, origin, direction);
+			}),
+			py::arg("array"), py::arg("spacing") = std::vector < double >(nDims, 1.0), py::arg("origin") = std::vector < double >(nDims, 0.0),
+			py::arg("direction") = std::vector < double >{ 1, 0, 0, 0, 1, 0, 0, 0, 1 })
+		.def_property_readonly("array", [](py::object self)
+			{
+				ImageType * image = self.cast < PythonImage & >().image.GetPointer();
+				return ViewBuffer(image, image->GetBufferPointer(), 1, self);
+			})
+		.def_property_readonly("spacing", &GetSpacing)
+		.def_property_readonly("origin", &GetOrigin)
+		.def_property_readonly("direction", &GetDirection);
+
+	py::class_ < FixedImageCacheType >(m, "FixedImageCache")
+		.def(py::init([](const PythonImage & fixed, const std::string & store)
+			{
+				return new FixedImageCacheType(fixed.image, atlas::ResultStore(store));
+			}),
+			// the cache points at the fixed image- keep it alive as long as the cache
+			py::arg("fixed"), py::arg("store") = "", py::keep_alive < 1, 2 >());
+
+	py::class_ < AccumulatorType >(m, "Accumulator")
+		.def(py::init < >())
+		.def("add", [](AccumulatorType & accumulator, const PythonImage & image, const std::string & subject)
+			{
+				py::gil_scoped_release release;
+				accumulator.Add(image.image, subject);
+			},
+			py::arg("image"), py::arg("subject") = "")
+		.def_property_readonly("count", &AccumulatorType::GetCount)
+		.def_property_readonly("subjects", &AccumulatorType::GetSubjects)
+		// view of the running sum (changes as images are added)
+		.def_property_readonly("sum", [](const AccumulatorType & accumulator)
+			{
+				if (accumulator.GetCount() == 0)
+				{
+					throw std::runtime_error("nothing accumulated");
+				}
+				return ViewOwnedBuffer(accumulator.GetSum(), accumulator.GetSum()->GetBufferPointer(), 1);
+			})
+		.def("mean", &GetMean)
+		.def("write_shard", [](const AccumulatorType & accumulator, const std::string & filename, const std::string & kind)
+			{
+				py::gil_scoped_release release;
+				accumulator.WriteShard(filename, kind);
+			},
+			py::arg("filename"), py::arg("kind"))
+		.def("merge_shard", [](AccumulatorType & accumulator, const std::string & filename, const std::string & kind)
+			{
+				py::gil_scoped_release release;
+				accumulator.MergeShard(filename, kind);
+			},
+			py::arg("filename"), py::arg("kind"));
+
+	m.def("register_affine", &RegisterAffine, "affine registration (options as for Registration, e.g. shrink=[4, 2, 1])",
+		py::arg("fixed"), py::arg("moving"), py::arg("subject") = "", py::arg("store") = "", py::arg("cache") = nullptr);
+	m.def("register_demons", &RegisterDemons, "Demons registration (options as for dRegistration, e.g. demonsIterations=60)",
+		py::arg("fixed"), py::arg("moving"), py::arg("subject") = "", py::arg("store") = "", py::arg("cache") = nullptr,
+		py::arg("return_field") = false);
+	m.def("read_image", &ReadImage, py::arg("filename"));
+	m.def("write_image", &WriteImage, py::arg("image"), py::arg("filename"));
+	m.def("set_threads", &atlas::SetNumberOfITKThreads, "ITK threads per registration (0 leaves the default)", py::arg("threads"));
+	m.def("set_trace", [](const std::string & filename) { atlas::Trace::GetInstance().SetFileName(filename); },
+		"trace file (.json or .csv) as -trace", py::arg("filename"));
+}
@@ -3,69 +3,209 @@
 #include <cstdlib>
 #include <stdlib.h>
 #include <sstream>
+#include <vector>
 #include "itkImage.h"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
-#include "itkAffineTransform.h"
-#include "itkMultiResolutionImageRegistrationMethod.h"
-#include "itkLinearInterpolateImageFunction.h"
-#include "itkRegularStepGradientDescentOptimizer.h"
-#include "itkResampleImageFilter.h"
-#include "itkMeanSquaresImageToImageMetric.h"
-#include "itkNaryAddImageFilter.h"
-#include "itkCommand.h"
-#include "itkDivideImageFilter.h"
+#include "AtlasAccumulator.h"
+#include "AtlasTypes.h"
+#include "AtlasOptions.h"
+#include "SubjectWorkerPool.h"
+#include "AffineRegistration.h"
+#include "DemonsRegistration.h"
+#include "SnapshotWriter.h"
+#include "AtlasTrace.h"
+#include "WorkQueue.h"
+#include "ResultStore.h"
+#include "FixedImageCache.h"
+#include "PrefetchReader.h"
 
 // constants
 const unsigned int nDims = 3 ;
 
 // set up types
-typedef itk::Image < double, nDims > ImageType ;
+typedef itk::Image < atlas::PixelType, nDims > ImageType ;
+typedef itk::Image < atlas::SumPixelType, nDims > SumImageType ;
 typedef itk::ImageFileReader < ImageType > ImageReaderType ; 
 typedef itk::ImageFileWriter < ImageType > ImageWriterType ;
-typedef itk::NaryAddImageFilter < ImageType, ImageType > AddFilterType ;
-typedef itk::DivideImageFilter < ImageType, ImageType, ImageType > DivideFilterType ;
-typedef itk::MultiResolutionImageRegistrationMethod < ImageType, ImageType > RegistrationMethodType ;
-typedef itk::AffineTransform < double, nDims > AffineTransformType ;
-typedef itk::RegularStepGradientDescentOptimizer OptimizerType ;
-typedef itk::LinearInterpolateImageFunction < ImageType > InterpolatorType ;
-typedef itk::ResampleImageFilter < ImageType, ImageType > ResampleFilterType ;
-typedef itk::MeanSquaresImageToImageMetric <ImageType, ImageType > MetricType ;
+typedef atlas::Accumulator < ImageType, SumImageType > AccumulatorType ;
+typedef itk::Vector < atlas::FieldComponentType, nDims > VectorPixelType ;
+typedef itk::Image < VectorPixelType, nDims > DisplacementFieldType ;
+typedef atlas::AffineRegistration < ImageType > AffineRegistrationType ;
+typedef AffineRegistrationType::SettingsType AffineSettings ;
+typedef AffineRegistrationType::AffineTransformType AffineTransformType ;
+typedef atlas::DemonsRegistration < ImageType, DisplacementFieldType > DemonsRegistrationType ;
+typedef atlas::FixedImageCache < ImageType > FixedImageCacheType ;
+typedef atlas::PrefetchReader < ImageType > PrefetchReaderType ;
 
-// callback for optimizer like in class
-class OptimizerIterationCallback : public itk::Command
+// what happens to each affine result
+struct PipelineSettings
 {
-public:
-	typedef OptimizerIterationCallback Self ;
-	typedef itk::Command Superclass ;
-	typedef itk::SmartPointer<OptimizerIterationCallback> Pointer ;
-	itkNewMacro(OptimizerIterationCallback);
+	bool writeAffine ; // write afKKI2009-XX-MPRAGE.nii.gz for dRegistration
+	bool deformable ; // fused mode: continue with the deformable stage in memory
+	bool streamed ; // sums kept on disk (-memoryBudget)
+	const ImageType * templateImage ; // fixed image of the deformable stage
+	FixedImageCacheType * fixedCache ; // what is computed from the fixed image alone, shared by the subjects
+	FixedImageCacheType * templateCache ; // the same for the template
+	PrefetchReaderType * prefetch ; // reads the upcoming subjects in the background (-prefetch)
+	atlas::SnapshotWriter * writer ; // writes the affine results in the background
+	atlas::DemonsSettings demons ;
+	atlas::ResultStore store ; // per-subject transforms and fields of earlier runs (-store=dir)
+	atlas::WorkQueue queue ; // subjects shared with other worker processes (-queue=dir)
+};
+
+// affinely register image fname (subject is, read into moving) to the fixed image
+// the transform goes through the result store (-store=dir): reused if nothing changed, warm-started otherwise
+// returns a null pointer if the registration fails
+AffineTransformType::Pointer AffinelyRegister(const ImageType * fixedImage, const std::string & is, const std::string & fname, const AffineSettings & settings,
+	const atlas::ResultStore & store, FixedImageCacheType * fixedCache, PrefetchReaderType & prefetch, ImageType::Pointer & moving)
+{
+	// usually already read in the background while the previous subjects registered
+	moving = prefetch.Get(fname, is);
+	std::cout << "now registering " << fname << std::endl;  
 
-	typedef const OptimizerType * OptimizerPointerType ;
-	// non-const if want to change 
-	void Execute(itk::Object * caller, const itk::EventObject & event)
+	// try to do registration
+	try {
+	return atlas::RegisterAffine(store, is, fixedImage, moving.GetPointer(), settings, fixedCache);
+	}
+	catch ( itk::ExceptionObject & err )
 	{
-		Execute((const itk::Object *) caller, event) ;
+	std::cerr << "Exception caught registering " << fname << std::endl;
+	std::cerr << err << std::endl;
+	return nullptr;
 	}
-	// const if just observing
-	void Execute(const itk::Object * caller, const itk::EventObject & event)
+}
+
+// affinely register subject i to the fixed image and add the result to the running sum
+// in the fused mode (-deformable=1) the affine result is handed in memory to the deformable stage,
+// which registers it to the template and adds the warped image to the deformable sum
+// may run concurrently for several subjects (see -jobs): everything here is per subject except
+// the fixed and template images (disconnected from their readers; only their buffers are shared, the registrations run
+// their filters on grafts, see GraftImage) and the accumulators (lock internally)
+bool RegisterSubject(const ImageType * fixedImage, int i, bool isFixed, const AffineSettings & settings,
+	const PipelineSettings & pipeline, AccumulatorType & tAccumulator, AccumulatorType & dAccumulator)
+{
+	std::string pre = "KKI2009-" ;
+	std::string post = "-MPRAGE.nii.gz" ;
+	std::string is = "";
+	std::stringstream o;
+	o << i;
+	std::string istr = o.str();
+	if (i < 10)
+	{
+		is = "0" + istr;
+	} else
 	{
-		OptimizerPointerType optimizer = dynamic_cast < OptimizerPointerType > ( caller ) ;
-		std::cout << " iteration: " << optimizer->GetCurrentIteration() << " value: " << optimizer->GetValue() << std::endl;
+		is = istr;
+	}
+	is = pre + is;
+	std::string fname = is + post;
+	if (!pipeline.queue.Claim(is)) {
+		// another worker has it
+		pipeline.prefetch->Discard(fname);
+		return true;
 	}
-};
+
+	ImageType::ConstPointer affineResult;
+	if (isFixed) {
+		// the fixed subject is already aligned with itself, it counts towards the template as is
+		affineResult = fixedImage;
+	} else {
+		ImageType::Pointer moving;
+		AffineTransformType::Pointer transform = AffinelyRegister(fixedImage, is, fname, settings, pipeline.store, pipeline.fixedCache, *pipeline.prefetch, moving);
+		if (transform.IsNull()) {
+			return false;
+		}
+		if (pipeline.streamed && !pipeline.writeAffine && !pipeline.deformable) {
+			// nothing else needs the whole affine result: resample it slab by slab straight into the sum
+			tAccumulator.AddStreamed(AffineRegistrationType::GetResampler(moving, transform, fixedImage).GetPointer(), is);
+			return true;
+		}
+		affineResult = AffineRegistrationType::Resample(moving, transform, fixedImage, is);
+	}
+
+	// store affinely registered image for deformable registration moving image (dRegistration reads afKKI2009-XX-MPRAGE.nii.gz)
+	// written in the background, so compressing it overlaps with the next registration
+	// the writer gets its own image object sharing the buffer (a graft): the Demons stage of the fused mode
+	// runs its pipeline on affineResult at the same time, and pipeline updates change the image object
+	if (pipeline.writeAffine) {
+		std::string resname = "af" + is + post;
+		ImageType::Pointer written = atlas::GraftImage(affineResult.GetPointer());
+		pipeline.writer->Push([written, resname, is]()
+		{
+			ImageWriterType::Pointer result = ImageWriterType::New();
+			result->SetFileName(resname);
+			result->SetInput( written );
+			atlas::TraceStage stage("write", is);
+			result->Update();
+			std::cout << "wrote result to " << resname << std::endl;
+		});
+	}
+
+	// the sums get the subject only once every stage succeeded (with a work queue a failed subject must not be in them)
+	ImageType::Pointer warped;
+	if (pipeline.deformable) {
+		std::cout << "deformably registering " << is << std::endl;
+		try {
+			warped = atlas::RegisterDemons < ImageType, DisplacementFieldType >(pipeline.store, is, pipeline.templateImage, affineResult, pipeline.demons, pipeline.templateCache);
+		}
+		catch (itk::ExceptionObject & err)
+		{
+			std::cerr << "Exception caught deformably registering " << fname << std::endl;
+			std::cerr << err << std::endl;
+			return false;
+		}
+	}
+	// add registered image to the running sum for affine template calculation
+	tAccumulator.Add(affineResult, is);
+	if (pipeline.deformable) {
+		dAccumulator.Add(warped, is);
+	}
+	return true;
+}
+
+// divide the sum by its count and write it as templateName (doDivide), or write it as a shard with
+// the subject count and IDs in the header
+void WriteSum(const AccumulatorType & accumulator, bool doDivide, const std::string & templateName, const std::string & shardName, const std::string & kind)
+{
+	if (doDivide) {
+		accumulator.WriteAverage(templateName);
+		std::cout << "wrote " << templateName << " (" << accumulator.GetCount() << " images)" << std::endl;
+	} else {
+		std::cout << "writing " + shardName + "..." << std::endl;
+		accumulator.WriteShard(shardName, kind);
+		std::cout <<  "wrote " << shardName << " (" << accumulator.GetCount() << " images)" << std::endl;
+	}
+}
 
 int main(int argc, char * argv[])
 {
 	 // assume parameters are expected types and fixed file is in the build directory i.e. can be accessed directly by filename
-	 if (argc < 6 || argc > 6)
+	 atlas::Options options;
+	 if (argc < 6 || !options.Parse(argc, argv, 6))
 	 {
-	 	// example ./Registration KKI2009-05-MPRAGE.nii.gz 1 10 1 0 --> affinely register images 1 to 10 to KKI2009-05-MPRAGE.nii.gz, divide the result and don't add an observer --> output file is a1_10intermediate.nii.gz
+	 	// example ./Registration KKI2009-05-MPRAGE.nii.gz 1 10 1 0 --> affinely register images 1 to 10 to KKI2009-05-MPRAGE.nii.gz, divide the result and don't add an observer --> output file is a1_10intermediate.nrrd
 		// usage: ./Registration  [-fixedImage=file] [-lower=num] [-upper=num] [-doDivide=num{0,1}] [-observe=num{0,1}] 
-	 	std::cout << "check parameters! usage: ./Registration  [-fixedImage=file] [-lower=num] [-upper=num] [-doDivide=num{0,1}] [-observe=num{0,1}]" << std::endl;
+	 	std::cout << "check parameters! usage: ./Registration  [-fixedImage=file] [-lower=num] [-upper=num] [-doDivide=num{0,1}] [-observe=num{0,1}] [options]" << std::endl;
 	 	std::cout << "(includes endpoints) 0 <= lower <= numberOfImages, lower < upper <= numberOfImages, doDivide = 0 --> don't divide final image, = 1 --> divide final image" << std::endl;
 		std::cout << "observe = 0 --> don't add observer, observe = 1 --> add observer" << std::endl; 
-		std::cout << "example: ./Registration KKI2009-05-MPRAGE.nii.gz 1 10 1 0 --> affinely register images 1 to 10 to KKI2009-05-MPRAGE.nii.gz, divide the result and don't add an observer --> output file is a1_10intermediate.nii.gz" << std::endl;
+		std::cout << "options: -jobs=num (subjects registered at once, default 1) -threads=num (ITK threads per subject, default cores / jobs)" << std::endl;
+		std::cout << "i/o: -prefetch=num (subjects read ahead in the background, default jobs, 0 off) -writeQueue=num (affine results waiting for the background writer, default 2)" << std::endl;
+		std::cout << "trace: -trace=file (.json or .csv: wall/CPU time and peak memory per stage and subject, metric per iteration)" << std::endl;
+		std::cout << "demons: -demonsIterations=num (default 60) -demonsSigma=num (field smoothing in voxels, default 1)" << std::endl;
+		std::cout << "multi-resolution demons: -demonsLevels=num (default 1) -demonsIterations=list (per level, coarsest first) -demonsRMS=num (stop a level below this RMS field change) -demonsPlateau=num (stop a level when the metric improved less than -demonsPlateauTolerance=num, default 0.001, over num iterations)" << std::endl;
+		std::cout << "compact fields: -fieldShrink=num (keep, store and warp with the field on a grid shrunk by num)" << std::endl;
+		std::cout << "foreground: -mask=num{0,1} (register only the padded bounding box of the heads, affine metric inside the fixed foreground) -maskPadding=mm (default 10)" << std::endl;
+		std::cout << "snapshots (observe): -snapshotInterval=num (iterations between snapshots, default 20) -snapshotShrink=num (write on a grid shrunk by num) -snapshotQueue=num (snapshots waiting to be written, default 2)" << std::endl;
+		std::cout << "pyramid: -levels=num -shrink=list -sigmas=list (voxels) -iterations=list -steps=list (max step length), lists are per level coarsest first" << std::endl;
+		std::cout << "optimizer: -scales={none, physical} (physical: per parameter scales, steps in mm, default step 1) -initialize={none, geometry, moments} -minimumStep=num -gradientTolerance=num (default 1e-4) -plateau=num (stop a level when the metric improved less than -plateauTolerance=num, default 0.001, over num iterations)" << std::endl;
+		std::cout << "sampling: -sampling={full, random, grid} -samples=num or -samplePercent=num -seed=num -resample=num{0,1} (new samples every iteration)" << std::endl;
+		std::cout << "fused: -deformable=num{0,1} (deformably register each affine result in memory, observe applies to both stages) -template=file (deformable fixed image, default the fixed image) -writeAffine=num{0,1} (write afKKI2009-XX-MPRAGE.nii.gz, default 1 unless deformable)" << std::endl;
+		std::cout << "work queue: -queue=dir (shared by worker processes started with the same range; subjects are claimed one at a time and the last worker to finish writes the templates)" << std::endl;
+		std::cout << "reruns: -store=dir (keep each subject's transform and field; unchanged subjects are skipped, changed ones warm-started)" << std::endl;
+		std::cout << "out of core: -memoryBudget=MB (sums kept in a<lower>_<upper>sum.mha / d<lower>_<upper>sum.mha and updated, divided and written slab by slab; templates and shards are written as .mha)" << std::endl;
+		std::cout << "example: ./Registration KKI2009-05-MPRAGE.nii.gz 1 10 1 0 -shrink=4,2,1 -sigmas=2,1,0 -iterations=200,100,20 -steps=0.05,0.025,0.0125" << std::endl;
+		std::cout << "example: ./Registration KKI2009-05-MPRAGE.nii.gz 1 10 1 0 --> affinely register images 1 to 10 to KKI2009-05-MPRAGE.nii.gz, divide the result and don't add an observer --> output file is a1_10intermediate.nrrd" << std::endl;
 		exit(EXIT_FAILURE);
 	 }
 
@@ -75,140 +215,134 @@ int main(int argc, char * argv[])
 	int upper = atoi(argv[3]);
 	int doDivide = atoi(argv[4]);
 	int observer = atoi(argv[5]);
+	AffineSettings settings;
+	settings.observer = observer;
+	if (!atlas::ReadAffineSettings(options, settings)) {
+		return EXIT_FAILURE;
+	}
+	PipelineSettings pipeline;
+	pipeline.deformable = options.GetInt("deformable", 0);
+	pipeline.writeAffine = options.GetInt("writeAffine", pipeline.deformable ? 0 : 1);
+	pipeline.demons.observe = observer;
+	// observer snapshots are warped and written in the background (finishes writing before exit)
+	atlas::SnapshotWriter snapshots(options.GetInt("snapshotQueue", 2));
+	atlas::ReadDemonsSettings(options, pipeline.demons);
+	pipeline.demons.snapshotWriter = &snapshots;
+	pipeline.store = atlas::ResultStore(options.GetString("store", ""));
+	pipeline.queue = atlas::WorkQueue(options.GetString("queue", ""));
+	atlas::Trace::GetInstance().SetFileName(options.GetString("trace", ""));
+	atlas::TraceStage total("total");
+	unsigned int jobs = options.GetInt("jobs", 1);
+	atlas::SetNumberOfITKThreads(atlas::ITKThreadsPerJob(jobs, options.GetInt("threads", 0)));
 
-   	AddFilterType::Pointer tAddFilter = AddFilterType::New() ; 	
+   	AccumulatorType tAccumulator ;
+   	AccumulatorType dAccumulator ;
+	// file range to strings
+	std::stringstream l;
+	std::stringstream u;
+	l << lower;
+	u << upper;
+	std::string lo = l.str();
+	std::string up = u.str();
+	// out of core: the sums live on disk and every step touches at most about memoryBudget MB of them
+	double memoryBudget = options.GetDouble("memoryBudget", 0);
+	pipeline.streamed = memoryBudget > 0 && !pipeline.queue.IsEnabled();
+	if (memoryBudget > 0 && pipeline.queue.IsEnabled()) {
+		std::cout << "-memoryBudget is ignored with -queue (partial sums are merged in memory)" << std::endl;
+	}
+	if (pipeline.streamed) {
+		tAccumulator.SetBackingFile("a" + lo + "_" + up + "sum.mha", memoryBudget);
+		dAccumulator.SetBackingFile("d" + lo + "_" + up + "sum.mha", memoryBudget);
+	}
+	// NIfTI can't be written in slabs
+	std::string templateExtension = pipeline.streamed ? ".mha" : ".nii.gz";
+	std::string shardExtension = pipeline.streamed ? ".mha" : ".nrrd";
    	ImageReaderType::Pointer fixedReader = ImageReaderType::New();
   	fixedReader->SetFileName(fixedImageFile);
    	fixedReader->Update();
+	// the fixed image is shared by all subject workers- detach it so no worker re-executes the reader
+	ImageType::Pointer fixedImage = fixedReader->GetOutput();
+	fixedImage->DisconnectPipeline();
+	pipeline.templateImage = fixedImage;
+	ImageType::Pointer templateImage;
+	if (pipeline.deformable && options.Has("template")) {
+		ImageReaderType::Pointer templateReader = ImageReaderType::New();
+		templateReader->SetFileName(options.GetString("template", ""));
+		templateReader->Update();
+		templateImage = templateReader->GetOutput();
+		templateImage->DisconnectPipeline();
+		pipeline.templateImage = templateImage;
+	}
+	// pyramid, samples and reference histogram of the fixed image and template, computed once for all subjects
+	FixedImageCacheType fixedCache(fixedImage, pipeline.store);
+	FixedImageCacheType templateCache(pipeline.templateImage, pipeline.store);
+	pipeline.fixedCache = &fixedCache;
+	pipeline.templateCache = pipeline.templateImage == fixedImage.GetPointer() ? &fixedCache : &templateCache;
    	// assumes file name is of the form KKI2009-05-MPRAGE.nii.gz  
 	std::string fixedFileNum = fixedImageFile.substr(8,2);
    	std::cout << "fixedFileNum " << fixedFileNum << std::endl;
 	std::stringstream f(fixedFileNum);
 	int ffn = 0;
 	f >> ffn;
-	std::string pre = "KKI2009-" ;
-	std::string post = "-MPRAGE.nii.gz" ;
+	std::vector < int > subjects;
+	std::vector < std::string > movingFiles;
 	for (int i = lower; i <= upper; ++i)
 	{
-	if ( i != ffn ) {
-		std::string is = "";
-		std::stringstream o;
-		o << i;
-		std::string istr = o.str();
-		if (i < 10)
-		{
-			is = "0" + istr;
-		} else
-		{
-			is = istr;
-		}
-		is = pre + is;
-		std::string fname = is + post;
-		ImageReaderType::Pointer movingReader = ImageReaderType::New();
-		movingReader->SetFileName( fname );
-		movingReader->Update() ;
-		std::cout << "now registering " << fname << std::endl;  
-		// gather registration materials 		
-		RegistrationMethodType::Pointer registration = RegistrationMethodType::New(); 
-		AffineTransformType::Pointer transform = AffineTransformType::New();
-		MetricType::Pointer metric = MetricType::New() ;
-		OptimizerType::Pointer optimizer = OptimizerType::New();		
-		InterpolatorType::Pointer interpolator = InterpolatorType::New() ;
-	
-		// set up affine registration
-		registration->SetFixedImage(fixedReader->GetOutput()) ;
-		registration->SetMovingImage(movingReader->GetOutput() );
-		registration->SetOptimizer ( optimizer ) ;
-		registration->SetMetric ( metric ) ;
-		registration->SetInterpolator ( interpolator ) ;
-		registration->SetTransform( transform ) ;
-		optimizer->MinimizeOn() ;
-		optimizer->SetNumberOfIterations ( 100 ) ;		
-		optimizer->SetMinimumStepLength( 0 ) ;
-		optimizer->SetMaximumStepLength( 0.0125 ) ;
-		transform->SetIdentity() ;
-		registration->SetInitialTransformParameters( transform->GetParameters() ) ;
-		registration->SetFixedImageRegion ( fixedReader->GetOutput()->GetLargestPossibleRegion() ) ;
-		// add callbacks based on observer flag argv[5]	
-		if (observer) {
-			OptimizerIterationCallback::Pointer optCallback = OptimizerIterationCallback::New();
-			optimizer->AddObserver(itk::IterationEvent(), optCallback); 
-		}
-
-		// try to do registration
-		try {
-		registration->Update();
-		std::cout << "stopped because " << optimizer->GetStopConditionDescription() << std::endl;
+		subjects.push_back(i);
+		if (i != ffn) {
+			std::stringstream name;
+			name << "KKI2009-" << (i < 10 ? "0" : "") << i << "-MPRAGE.nii.gz";
+			movingFiles.push_back(name.str());
 		}
-		catch ( itk::ExceptionObject & err )
+	}
+	// look-ahead of one image per job by default; the results are written by one background thread
+	atlas::SnapshotWriter results(options.GetInt("writeQueue", 2));
+	bool ok;
+	{
+		PrefetchReaderType prefetch(movingFiles, options.GetInt("prefetch", jobs));
+		pipeline.prefetch = &prefetch;
+		pipeline.writer = &results;
+		ok = atlas::RunSubjects(subjects, jobs, [&](int i)
 		{
-		std::cerr << "Exception caught" << std::endl;
-		std::cerr << err << std::endl;
+			std::stringstream subject;
+			subject << "KKI2009-" << (i < 10 ? "0" : "") << i;
+			return pipeline.queue.Run(subject.str(), [&]()
+			{
+				return RegisterSubject(fixedImage, i, i == ffn, settings, pipeline, tAccumulator, dAccumulator);
+			});
+		});
+	}
+	results.Flush();
+	ok = ok && results.GetNumberOfFailures() == 0;
+	// with a queue the failed subjects are recorded and what did register is still published (see WorkQueue.h)
+	if (!ok && !pipeline.queue.IsEnabled()) {
 		return EXIT_FAILURE;
-		}
-
-		// apply transform
-		ResampleFilterType::Pointer resampleFilter = ResampleFilterType::New() ;
-		resampleFilter->SetInput ( movingReader->GetOutput() ) ;
-		resampleFilter->SetTransform ( transform ) ;
-		resampleFilter->SetReferenceImage( fixedReader->GetOutput()) ;
-		resampleFilter->UseReferenceImageOn() ;		
-	        resampleFilter->Update() ; 
-			
-		// add registered image to add filter for affine template calculation- depends on lower
-		if (lower == 1){
-			// have to set input at zero index so no complaining (itk::ERROR:
-			// NaryAddImageFilter Input Primary is required but not set.)
-			tAddFilter->SetInput(i-1, resampleFilter->GetOutput());
-		} else if (lower > 1 && i == lower){
-			tAddFilter->SetInput(0, resampleFilter->GetOutput());
-		} else {
-			tAddFilter->SetInput(i-lower, resampleFilter->GetOutput());
-		}
-
-		// store affinely registered image for deformable registration moving image
-		ImageWriterType::Pointer result = ImageWriterType::New();
-		std::string resname = is + post;
-		result->SetFileName(resname);
-		result->SetInput( resampleFilter->GetOutput() );
-		result->Update();
-		std::cout << "wrote result to " << resname << std::endl;
-		} // end if 
-	} // end for
-// update add filter
-tAddFilter->Update();
+	}
+if (tAccumulator.GetCount() == 0 && !pipeline.queue.IsEnabled()) {
+	std::cerr << "no images registered in range " << lower << " to " << upper << std::endl;
+	return EXIT_FAILURE;
+}
 
-// file range to strings
-std::stringstream l;
-std::stringstream u;
-l << lower;
-u << upper;
-std::string lo = l.str();
-std::string up = u.str();
-		
-// doDivide = 1 --> divide added images by upper - lower + 1 for affine template
-// doDivide = 0 --> just output the added images from lower to upper (for distributed runs, 
-// eg run1: lower = 1 and upper = 11; run2: lower = 12 and upper = 21)
-ImageWriterType::Pointer writer = ImageWriterType::New() ;
-if (doDivide) {
-	DivideFilterType::Pointer divFilter = DivideFilterType::New();
-	divFilter->SetInput(tAddFilter->GetOutput());
-	divFilter->SetConstant(upper - lower + 1);
-	divFilter->Update();
-	std::string aname = lo + "_" + up + "affineTemplate" + ".nii.gz";
-	writer->SetFileName( aname ) ;
-	writer->SetInput( divFilter->GetOutput()) ;
-	writer->Update();
-	std::cout << "wrote " << aname << std::endl;
-} else {
-	// just write added images
-	std::string aname = "a" + lo + "_" + up + "intermediate.nii.gz";
-	std::cout << "writing " + aname + "..." << std::endl;
-	writer->SetFileName(aname);
-	writer->SetInput(tAddFilter->GetOutput());
-        writer->Update();	
-	std::cout <<  "wrote " << aname << std::endl;
+if (pipeline.queue.IsEnabled()) {
+	// the worker that completes a sum writes the template, the others leave their partial sums in the queue
+	unsigned int total = upper - lower + 1;
+	if (pipeline.queue.Reduce(tAccumulator, "a", total)) {
+		WriteSum(tAccumulator, true, lo + "_" + up + "affineTemplate" + ".nii.gz", "", "a");
+	}
+	if (pipeline.deformable && pipeline.queue.Reduce(dAccumulator, "d", total)) {
+		WriteSum(dAccumulator, true, lo + "_" + up + "deformableAtlas" + ".nii.gz", "", "d");
+	}
+	return ok && !pipeline.queue.HasFailures() ? 0 : EXIT_FAILURE;
 }
+
+// doDivide = 1 --> divide added images by the number of images added for affine template
+// doDivide = 0 --> just output the added images from lower to upper as a shard (for distributed runs, 
+// eg run1: lower = 1 and upper = 11; run2: lower = 12 and upper = 21; then ./Setup merge a a1_11intermediate.nrrd a12_21intermediate.nrrd)
+WriteSum(tAccumulator, doDivide, lo + "_" + up + "affineTemplate" + templateExtension, "a" + lo + "_" + up + "intermediate" + shardExtension, "a");
 // done with affine registration.
+if (pipeline.deformable) {
+	// same outputs as dRegistration
+	WriteSum(dAccumulator, doDivide, lo + "_" + up + "deformableAtlas" + templateExtension, "d" + lo + "_" + up + "intermediate" + shardExtension, "d");
+}
 return 0;
 }
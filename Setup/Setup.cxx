@@ -2,25 +2,50 @@
 #include <string>
 #include <cstdlib>
 #include <sstream>
+#include <vector>
 #include "itkImage.h"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 #include "itkDivideImageFilter.h"
-#include "itkNaryAddImageFilter.h"
+#include "AtlasAccumulator.h"
+#include "AtlasTypes.h"
+#include "AtlasTrace.h"
+#include "PrefetchReader.h"
 
 // constants
 const unsigned int nDims = 3 ;
 const unsigned int imageCount = 21 ;
+// images read ahead in the background while the current one is added
+const unsigned int lookAhead = 2 ;
 
 // set up types
-typedef itk::Image < double, nDims > ImageType ;
+typedef itk::Image < atlas::PixelType, nDims > ImageType ;
+typedef itk::Image < atlas::SumPixelType, nDims > SumImageType ;
 typedef itk::ImageFileReader < ImageType > ImageReaderType ;
+typedef itk::ImageFileReader < SumImageType > SumImageReaderType ;
 typedef itk::ImageFileWriter < ImageType > ImageWriterType ;
-typedef itk::NaryAddImageFilter < ImageType, ImageType > AddFilterType ;
-typedef itk::DivideImageFilter < ImageType, ImageType, ImageType  > DivideFilterType ;
+typedef atlas::Accumulator < ImageType, SumImageType > AccumulatorType ;
+// intermediate files are sums, so they are read and added at sum precision
+typedef atlas::Accumulator < SumImageType, SumImageType > SumAccumulatorType ;
+typedef atlas::PrefetchReader < ImageType > PrefetchReaderType ;
+typedef atlas::PrefetchReader < SumImageType > SumPrefetchReaderType ;
+typedef itk::DivideImageFilter < SumImageType, SumImageType, ImageType  > DivideFilterType ;
 
 int main(int argc, char * argv[])
 {
+	// -trace=file may be given anywhere; it is taken out before the positional arguments are read
+	int kept = 1;
+	for (int k = 1; k < argc; ++k) {
+		std::string arg = argv[k];
+		if (arg.compare(0, 7, "-trace=") == 0) {
+			atlas::Trace::GetInstance().SetFileName(arg.substr(7));
+		} else {
+			argv[kept++] = argv[k];
+		}
+	}
+	argc = kept;
+	atlas::TraceStage total("total");
+
 	// assume parameters are expected types - # args varies
 	if (argc < 2)
        	{
@@ -28,17 +53,64 @@ int main(int argc, char * argv[])
 		// example ./Setup a 3 21 file1.nii.gz file2.nii.gz file3.nii.gz --> get affine template made of (file1 + file2 + file3) / 21
 		std::cout << "check parameters! usage: ./Setup [-templateType={i, a, d}] [-numImages=num] [-constant=num] [-filenames= {numImages} strings]" << std::endl;
 		std::cout << "example ./Setup a 3 21 file1.nii.gz file2.nii.gz file3.nii.gz" << std::endl;
+		std::cout << "or merge shards written by Registration/dRegistration (doDivide = 0): ./Setup merge [-shardType={a, d}] [-shards= strings]" << std::endl;
+		std::cout << "example ./Setup merge a a1_11intermediate.nrrd a12_21intermediate.nrrd" << std::endl;
+		std::cout << "any mode: -trace=file (.json or .csv: wall/CPU time and peak memory per stage)" << std::endl;
 		exit(EXIT_FAILURE);
 	}
 
 	// assume necessary images are in the build directory 
 	// i/a/d = get initial/affine/deformable template/template/atlas	
+	// merge = get affine/deformable template/atlas from shards, dividing by their total image count
 	std::string templateType = argv[1];
 
-	if (templateType == "i") {
+	if (templateType == "merge") {
+		if (argc < 4 || (std::string(argv[2]) != "a" && std::string(argv[2]) != "d")) {
+			std::cout << "usage: ./Setup merge [-shardType={a, d}] [-shards= strings]" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		std::string shardType = argv[2];
+		// shards are read and added one at a time, so only the sum and one shard are in memory
+		SumAccumulatorType accumulator;
+		try {
+			for (int j = 3; j < argc; j++) {
+				accumulator.MergeShard(argv[j], shardType);
+				std::cout << "merged " << argv[j] << " (" << accumulator.GetCount() << " images so far)" << std::endl;
+			}
+		}
+		catch (itk::ExceptionObject & err) {
+			std::cerr << err << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		if (accumulator.GetCount() == 0) {
+			std::cout << "shards hold no images" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		// divide by the number of images recorded in the shards
+		DivideFilterType::Pointer divFilter = DivideFilterType::New();
+		divFilter->SetInput(accumulator.GetSum());
+		divFilter->SetConstant(accumulator.GetCount());
+		divFilter->Update();
+		std::string outname = shardType == "a" ? "affineTemplate.nii.gz" : "deformableTemplate.nii.gz";
+		ImageWriterType::Pointer writer = ImageWriterType::New();
+		writer->SetFileName(outname);
+		writer->SetInput(divFilter->GetOutput());
+		atlas::TraceStage stage("write", outname);
+		writer->Update();
+		std::cout << "wrote " << outname << " (average of " << accumulator.GetCount() << " images)" << std::endl;
+
+	} else if (templateType == "i") {
 		// make initial template
-		AddFilterType::Pointer addFilter = AddFilterType::New();
+		AccumulatorType accumulator;
 		std::cout << "loading images for initial template..." << std::endl;
+		std::vector < std::string > names;
+		for (unsigned int i = 1; i <= imageCount; i++)
+		{
+			std::stringstream name;
+			name << "KKI2009-" << (i < 10 ? "0" : "") << i << "-MPRAGE.nii.gz";
+			names.push_back(name.str());
+		}
+		PrefetchReaderType prefetch(names, lookAhead);
 		// adapted from https://discourse.itk.org/t/beginner-in-itk-averaging-image/2328/4
 		for (int i = 1; i <= imageCount; i++)
 	 	{
@@ -56,23 +128,23 @@ int main(int argc, char * argv[])
 			}
 			std::string pre = "KKI2009-";
 			std::string post = "-MPRAGE.nii.gz";
-			ImageReaderType::Pointer reader = ImageReaderType::New();
-			reader->SetFileName(pre + is + post);
-			reader->Update();
-			addFilter->SetInput(i-1, reader->GetOutput());
+			// read in the background while the previous image was added
+			ImageType::Pointer image = prefetch.Get(pre + is + post, pre + is);
+			// added into the running sum, image released at end of iteration
+			accumulator.Add(image);
 			std::cout << "added image " << pre + is + post << std::endl;
 		} // end for
 		// all 21 images added together
-  		addFilter->Update();
 		// divide by imageCount
 		DivideFilterType::Pointer divFilter = DivideFilterType::New();
-		divFilter->SetInput(addFilter->GetOutput());
+		divFilter->SetInput(accumulator.GetSum());
 		divFilter->SetConstant( imageCount );
 		divFilter->Update();
 	        // write image	
 		ImageWriterType::Pointer writer = ImageWriterType::New();
 		writer->SetFileName( "initialTemplate.nii.gz" );
 		writer->SetInput( divFilter->GetOutput());
+		atlas::TraceStage stage("write", "initialTemplate.nii.gz");
 		writer->Update();
 		std::cout << "wrote initialTemplate.nii.gz " << std::endl; 
 	
@@ -87,19 +159,24 @@ int main(int argc, char * argv[])
 			std::cout << "loading images for deformable atlas..." << std::endl;
 		}
 		// the files to divide
-		AddFilterType::Pointer addFilter = AddFilterType::New();
+		SumAccumulatorType accumulator;
+		std::vector < std::string > names;
+		for (int j = 0; j < numImages; j++) {
+			names.push_back(argv[4+j]);
+		}
+		SumPrefetchReaderType prefetch(names, lookAhead);
 		for (int j = 0; j < numImages; j++){	
 			std::string fname = argv[4+j];
-			ImageReaderType::Pointer reader = ImageReaderType::New();
-			reader->SetFileName( fname );
-			reader->Update();
-			addFilter->SetInput(j, reader->GetOutput());
+			accumulator.Add(prefetch.Get(fname));
 			std::cout << "added image " << fname << std::endl;
 		} // end for
-		addFilter->Update();
+		if (accumulator.GetCount() == 0) {
+			std::cout << "no images to divide" << std::endl;
+			exit(EXIT_FAILURE);
+		}
 		// divide by constant (may or may not be equal to numImages)
 		DivideFilterType::Pointer divFilter = DivideFilterType::New();
-		divFilter->SetInput(addFilter->GetOutput());
+		divFilter->SetInput(accumulator.GetSum());
 		divFilter->SetConstant(constant);
 		divFilter->Update();
 		// write image
@@ -110,6 +187,7 @@ int main(int argc, char * argv[])
 			writer->SetFileName("deformableTemplate.nii.gz");
 		}
 		writer->SetInput( divFilter->GetOutput());
+		atlas::TraceStage stage("write", templateType == "a" ? "affineTemplate.nii.gz" : "deformableTemplate.nii.gz");
 		writer->Update();
 		std::cout << "writing template..." << std::endl;
 		if (templateType == "a") {
@@ -2,102 +2,110 @@
 #include <stdlib.h>
 #include <string>
 #include <sstream>
+#include <vector>
 #include <typeinfo>
 #include "itkImage.h"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 #include "itkVector.h"
-#include "itkSymmetricForcesDemonsRegistrationFilter.h"
-#include "itkHistogramMatchingImageFilter.h"
-#include "itkWarpImageFilter.h"
-#include "itkLinearInterpolateImageFunction.h"
-#include "itkCommand.h"
-#include "itkNaryAddImageFilter.h"
-#include "itkDivideImageFilter.h"
+#include "AtlasAccumulator.h"
+#include "AtlasTypes.h"
+#include "AtlasOptions.h"
+#include "SubjectWorkerPool.h"
+#include "DemonsRegistration.h"
+#include "SnapshotWriter.h"
+#include "AtlasTrace.h"
+#include "WorkQueue.h"
+#include "ResultStore.h"
+#include "FixedImageCache.h"
+#include "PrefetchReader.h"
 
 const unsigned int nDims = 3;
 
 // set up types
-typedef itk::Image < double, nDims > ImageType ;
+typedef itk::Image < atlas::PixelType, nDims > ImageType ;
+typedef itk::Image < atlas::SumPixelType, nDims > SumImageType ;
 typedef itk::ImageFileReader < ImageType > ImageReaderType ; 
 typedef itk::ImageFileWriter < ImageType > ImageWriterType ;
-typedef itk::HistogramMatchingImageFilter <ImageType, ImageType> MatchingFilterType;
-typedef itk::Vector<double, nDims> VectorPixelType;
+typedef itk::Vector<atlas::FieldComponentType, nDims> VectorPixelType;
 typedef itk::Image<VectorPixelType, nDims> DisplacementFieldType;
-typedef itk::SymmetricForcesDemonsRegistrationFilter<ImageType, ImageType, DisplacementFieldType> RegistrationFilterType;
-typedef itk::WarpImageFilter<ImageType, ImageType, DisplacementFieldType> WarperType;
-typedef itk::LinearInterpolateImageFunction< ImageType, double> InterpolatorType;
-typedef itk::NaryAddImageFilter < ImageType, ImageType > AddFilterType ;
-typedef itk::DivideImageFilter<ImageType, ImageType, ImageType> DivideFilterType;
+typedef atlas::DemonsRegistration < ImageType, DisplacementFieldType > DemonsRegistrationType ;
+typedef atlas::FixedImageCache < ImageType > FixedImageCacheType ;
+typedef atlas::PrefetchReader < ImageType > PrefetchReaderType ;
+typedef atlas::Accumulator < ImageType, SumImageType > AccumulatorType ;
 
-// used code from: https://itk.org/Doxygen/html/Examples_2RegistrationITKv3_2DeformableRegistration3_8cxx-example.html to set up the registration and part of callback
-// the callback for writing images during deformable registration- observer added if observe flag is set by user
-class CommandIterationUpdate : public itk::Command
+// deformably register subject i to the fixed image and add the warped result to the running sum
+// may run concurrently for several subjects (see -jobs): everything here is per subject except
+// the fixed image (disconnected from its reader; only its buffer is shared, the registration runs its filters on a
+// graft, see GraftImage) and the accumulator (locks internally)
+// fields go through the result store (-store=dir): reused if nothing changed, warm-started otherwise
+// with a work queue (-queue=dir) only the subjects this worker claims are registered
+bool RegisterSubject(const ImageType * fixedImage, int i, const atlas::DemonsSettings & settings, const atlas::ResultStore & store,
+	const atlas::WorkQueue & queue, FixedImageCacheType & fixedCache, PrefetchReaderType & prefetch, AccumulatorType & dAccumulator)
 {
-	public:
-	typedef CommandIterationUpdate Self ;
-	typedef itk::Command Superclass ;
-	typedef itk::SmartPointer<Self> Pointer ;	
-	itkNewMacro(CommandIterationUpdate);
-		
-	protected:
-	typedef itk::Image <double, nDims > ImageType;
-	typedef itk::Vector<double, nDims> VectorPixelType;
-	typedef itk::Image<VectorPixelType, nDims> DisplacementFieldType;
-	typedef itk::SymmetricForcesDemonsRegistrationFilter<ImageType, ImageType, DisplacementFieldType> RegistrationFilterType;
-	typedef itk::WarpImageFilter<ImageType, ImageType, DisplacementFieldType> WarperType;
-	typedef itk::LinearInterpolateImageFunction< ImageType, double> InterpolatorType;
-
-	public:
-	void Execute(itk::Object * caller, const itk::EventObject & event) 
+	// affinely registered files for moving images- assume they are in build directory, change as needed
+	std::string pre = "afKKI2009-";
+	std::string post = "-MPRAGE.nii.gz";
+	std::string is = "";
+	std::stringstream o;
+	o << i;
+	std::string istr = o.str();
+	if (i < 10)
 	{
-		Execute( (const itk::Object *)caller, event);
+		is = "0" + istr;
+	} else
+	{
+		is = istr;
+	}
+	is = pre + is;
+	std::string fname = is + post;
+	if (!queue.Claim(is.substr(2))) {
+		// another worker has it
+		prefetch.Discard(fname);
+		return true;
 	}
+	// usually already read in the background while the previous subjects registered
+	ImageType::Pointer moving = prefetch.Get(fname, is.substr(2));
+	std::cout << "deformably registering " << fname << std::endl;
 
-	void Execute(const itk::Object * object, const itk::EventObject & event)
+	// histogram matching, demons and warping (Common/DemonsRegistration.h)
+	ImageType::Pointer warped;
+	// (try to) do registration
+	try {
+		warped = atlas::RegisterDemons < ImageType, DisplacementFieldType >(store, is.substr(2), fixedImage, moving, settings, &fixedCache);
+	}
+	catch (itk::ExceptionObject & err)
 	{
-		const RegistrationFilterType * filter =  static_cast< const RegistrationFilterType * >( object );
-		int currentIteration = filter->GetElapsedIterations();  
-		std::cout << "elapsed iterations " << currentIteration << std::endl;
-		if (currentIteration == 1 || currentIteration % 20 == 0){
-			
-			// grab images from current registration	
-			const ImageType * movingImage = static_cast <const ImageType *>(filter->GetMovingImage());
-			const ImageType * fixedImage = static_cast <const ImageType *>(filter->GetFixedImage());
-
-			// set up warper
-			InterpolatorType::Pointer interpolator = InterpolatorType::New();
-			WarperType::Pointer warper = WarperType::New();
-			warper->SetInput(movingImage);
-			warper->SetInterpolator(interpolator) ;
-			warper->SetOutputSpacing(fixedImage->GetSpacing());
-			warper->SetOutputOrigin(fixedImage->GetOrigin());
-			warper->SetOutputDirection(fixedImage->GetDirection());
-			warper->SetDisplacementField(filter->GetOutput());
-			warper->Update();			
-			std::stringstream itnum;
-			itnum << currentIteration;
-			std::string fname = "out" + itnum.str() + ".nii.gz";
-			std::cout << "writing " << fname << "..." << std::endl;	
-			// write image with transform at current iteration
-			ImageWriterType::Pointer writer = ImageWriterType::New();	
-			writer->SetFileName(fname);
-			writer->SetInput(warper->GetOutput());
-			writer->Update();	
-			std::cout << "wrote " << fname << std::endl;
-		}	
+		std::cout << "exception registering " << fname << std::endl;
+		std::cout << err << std::endl;
+		return false;
 	}
-};			       
+	std::cout << "adding img " << i << " to running sum" << std::endl;
+	dAccumulator.Add(warped, is.substr(2));
+	return true;
+}
 
 int main(int argc, char * argv[])
 {
 	// assume parameters are expected types and the fixed file is in the build directory i.e. can be accessed directly by filename 
-	if (argc < 6 || argc > 6)
+	atlas::Options options;
+	if (argc < 6 || !options.Parse(argc, argv, 6))
 	{
-		// example: ./dRegistration affineTemplate.nii.gz 1 12 0 1 --> deformably register images 1 to 12 to affineTemplate.nii.gz, don't divide the result and add an observer --> output file includes intermediate deformable templates and  d1_12intermediate.nii.gz 
-		std::cout << "check parameters! usage: ./dRegistration [-fixedImage=filename] [-lower=num] [-upper=num] [-doDivide=num{0,1}] [-observe=num{0,1}]" << std::endl;
+		// example: ./dRegistration affineTemplate.nii.gz 1 12 0 1 --> deformably register images 1 to 12 to affineTemplate.nii.gz, don't divide the result and add an observer --> output file includes intermediate deformable templates and  d1_12intermediate.nrrd 
+		std::cout << "check parameters! usage: ./dRegistration [-fixedImage=filename] [-lower=num] [-upper=num] [-doDivide=num{0,1}] [-observe=num{0,1}] [options]" << std::endl;
 		std::cout << "(includes endpoints) 0 <= lower <= numberOfImages, lower < upper <= numberOfImages , doDivide = 0/1 --> don't divide/do divide final image; observe = 0/1 don't add/do add observer for intermediate deformable templates" << std::endl;
-		std::cout << "./dRegistration affineTemplate.nii.gz 1 12 0 1 --> deformably register images 1 to 12 to affineTemplate.nii.gz, don't divide the result and add an observer --> output file includes intermediate deformable templates and  d1_12intermediate.nii.gz" << std::endl;
+		std::cout << "options: -jobs=num (subjects registered at once, default 1) -threads=num (ITK threads per subject, default cores / jobs)" << std::endl;
+		std::cout << "i/o: -prefetch=num (subjects read ahead in the background, default jobs, 0 off)" << std::endl;
+		std::cout << "trace: -trace=file (.json or .csv: wall/CPU time and peak memory per stage and subject, metric per iteration)" << std::endl;
+		std::cout << "demons: -demonsIterations=num (default 60) -demonsSigma=num (field smoothing in voxels, default 1)" << std::endl;
+		std::cout << "multi-resolution demons: -demonsLevels=num (default 1) -demonsIterations=list (per level, coarsest first) -demonsRMS=num (stop a level below this RMS field change) -demonsPlateau=num (stop a level when the metric improved less than -demonsPlateauTolerance=num, default 0.001, over num iterations)" << std::endl;
+		std::cout << "compact fields: -fieldShrink=num (keep, store and warp with the field on a grid shrunk by num)" << std::endl;
+		std::cout << "foreground: -mask=num{0,1} (Demons runs only on the union of the padded bounding boxes of the fixed and moving heads, the field is zero outside it) -maskPadding=mm (default 10)" << std::endl;
+		std::cout << "snapshots (observe): -snapshotInterval=num (iterations between snapshots, default 20) -snapshotShrink=num (write on a grid shrunk by num) -snapshotQueue=num (snapshots waiting to be written, default 2)" << std::endl;
+		std::cout << "work queue: -queue=dir (shared by worker processes started with the same range; subjects are claimed one at a time and the last worker to finish writes the atlas)" << std::endl;
+		std::cout << "reruns: -store=dir (keep each subject's field; unchanged subjects are skipped, changed ones warm-started)" << std::endl;
+		std::cout << "out of core: -memoryBudget=MB (sum kept in d<lower>_<upper>sum.mha and updated, divided and written slab by slab; the atlas and shard are written as .mha)" << std::endl;
+		std::cout << "./dRegistration affineTemplate.nii.gz 1 12 0 1 --> deformably register images 1 to 12 to affineTemplate.nii.gz, don't divide the result and add an observer --> output file includes intermediate deformable templates and  d1_12intermediate.nrrd" << std::endl;
 		exit(0);	
 	}	
 	
@@ -107,121 +115,100 @@ int main(int argc, char * argv[])
 	int upper = atoi(argv[3]);
 	int doDivide = atoi(argv[4]);
 	int observer = atoi(argv[5]);
+	atlas::DemonsSettings settings;
+	settings.observe = observer;
+	// observer snapshots are warped and written in the background (finishes writing before exit)
+	atlas::SnapshotWriter snapshots(options.GetInt("snapshotQueue", 2));
+	atlas::ReadDemonsSettings(options, settings);
+	settings.snapshotWriter = &snapshots;
+	atlas::ResultStore store(options.GetString("store", ""));
+	atlas::WorkQueue queue(options.GetString("queue", ""));
+	atlas::Trace::GetInstance().SetFileName(options.GetString("trace", ""));
+	atlas::TraceStage total("total");
+	unsigned int jobs = options.GetInt("jobs", 1);
+	atlas::SetNumberOfITKThreads(atlas::ITKThreadsPerJob(jobs, options.GetInt("threads", 0)));
 
-	// affinely registered files for moving images- assume they are in build directory, change as needed
-	std::string pre = "afKKI2009-";
-	std::string post = "-MPRAGE.nii.gz";
-
-	AddFilterType::Pointer dAddFilter = AddFilterType::New() ; 	
+	// file range to strings
+	std::stringstream l;
+	std::stringstream u;
+	l << lower;
+	u << upper;
+	std::string lo = l.str();
+	std::string up = u.str();
+	AccumulatorType dAccumulator ;
+	// out of core: the sum lives on disk and every step touches at most about memoryBudget MB of it
+	double memoryBudget = options.GetDouble("memoryBudget", 0);
+	bool streamed = memoryBudget > 0 && !queue.IsEnabled();
+	if (memoryBudget > 0 && queue.IsEnabled()) {
+		std::cout << "-memoryBudget is ignored with -queue (partial sums are merged in memory)" << std::endl;
+	}
+	if (streamed) {
+		dAccumulator.SetBackingFile("d" + lo + "_" + up + "sum.mha", memoryBudget);
+	}
 	ImageReaderType::Pointer fixedReader = ImageReaderType::New();
 	fixedReader->SetFileName(atname);
 	fixedReader->Update();
-       
+	// the fixed image is shared by all subject workers- detach it so no worker re-executes the reader
+	ImageType::Pointer fixedImage = fixedReader->GetOutput();
+	fixedImage->DisconnectPipeline();
+
+	// reference histogram of the fixed image, computed once for all subjects
+	FixedImageCacheType fixedCache(fixedImage);
+	std::vector < int > subjects;
+	std::vector < std::string > movingFiles;
 	for (int i = lower; i <= upper; ++i)
 	{
-		std::string is = "";
-		std::stringstream o;
-		o << i;
-		std::string istr = o.str();
-		if (i < 10)
-		{
-			is = "0" + istr;
-		} else
-		{
-			is = istr;
-		}
-		is = pre + is;
-		std::string fname = is + post;
-		std::cout << "deformably registering " << fname << std::endl;
-	
-		ImageReaderType::Pointer movingReader = ImageReaderType::New();
-		movingReader->SetFileName( fname );
-		movingReader->Update();
-		// intensity matching of fixed and moving images
-		MatchingFilterType::Pointer matcher = MatchingFilterType::New();
-		matcher->SetInput(movingReader->GetOutput());
-		matcher->SetReferenceImage(fixedReader->GetOutput());
-		matcher->SetNumberOfHistogramLevels(1024);
-		matcher->SetNumberOfMatchPoints(7);
-		matcher->ThresholdAtMeanIntensityOn();
-		RegistrationFilterType::Pointer dregistration = RegistrationFilterType::New();
-
-		// add callback based on observer flag argv[5]
-		if (observer) {
-			CommandIterationUpdate::Pointer observer = CommandIterationUpdate::New();
-			dregistration->AddObserver(itk::IterationEvent(), observer);
-		}
-		dregistration->SetFixedImage(fixedReader->GetOutput());
-		dregistration->SetMovingImage(matcher->GetOutput());
-		dregistration->SetNumberOfIterations(60);
-		dregistration->SetStandardDeviations(1.0);
-
-		// (try to) do registration
-		try {
-			dregistration->Update();
-		}
-		catch (itk::ExceptionObject & err)
+		subjects.push_back(i);
+		std::stringstream name;
+		name << "afKKI2009-" << (i < 10 ? "0" : "") << i << "-MPRAGE.nii.gz";
+		movingFiles.push_back(name.str());
+	}
+	bool ok;
+	{
+		// look-ahead of one image per job by default
+		PrefetchReaderType prefetch(movingFiles, options.GetInt("prefetch", jobs));
+		ok = atlas::RunSubjects(subjects, jobs, [&](int i)
 		{
-			std::cout << err << std::endl;
-			return EXIT_FAILURE;
-		}
-
-		// do transformation
-		WarperType::Pointer warper = WarperType::New();
-		InterpolatorType::Pointer interpolator = InterpolatorType::New();	
-		warper->SetInput(movingReader->GetOutput());
-		warper->SetInterpolator(interpolator);
-		warper->SetOutputSpacing(fixedReader->GetOutput()->GetSpacing());
-		warper->SetOutputOrigin(fixedReader->GetOutput()->GetOrigin());
-		warper->SetOutputDirection(fixedReader->GetOutput()->GetDirection());
-		warper->SetDisplacementField(dregistration->GetOutput());
-		warper->Update();
-		std::cout << "adding img " << i << " to add filter" << std::endl;
-		if (lower == 1) {
-			// have to set input at zero index so no complaining (itk::ERROR:
-			// NaryAddImageFilter Input Primary is required but not set.)
-			dAddFilter->SetInput(i-1, warper->GetOutput());
-		} else if (lower > 1 && i == lower) {
-			dAddFilter->SetInput(0, warper->GetOutput());
-		} else {
-		dAddFilter->SetInput(i-lower, warper->GetOutput());
-		}
-	} // end for
-// update add filter
-dAddFilter->Update();
-
-// file range to strings
-std::stringstream l;
-std::stringstream u;
-l << lower;
-u << upper;
-std::string lo = l.str();
-std::string up = u.str();
+			std::stringstream subject;
+			subject << "KKI2009-" << (i < 10 ? "0" : "") << i;
+			return queue.Run(subject.str(), [&]()
+			{
+				return RegisterSubject(fixedImage, i, settings, store, queue, fixedCache, prefetch, dAccumulator);
+			});
+		});
+	}
+	// with a queue the failed subjects are recorded and what did register is still published (see WorkQueue.h)
+	if (!ok && !queue.IsEnabled()) {
+		return EXIT_FAILURE;
+	}
+if (queue.IsEnabled()) {
+	// the worker that completes the sum writes the atlas, the others leave their partial sums in the queue
+	if (!queue.Reduce(dAccumulator, "d", upper - lower + 1)) {
+		return ok && !queue.HasFailures() ? 0 : EXIT_FAILURE;
+	}
+	doDivide = 1;
+}
+if (dAccumulator.GetCount() == 0) {
+	std::cout << "no images registered in range " << lower << " to " << upper << std::endl;
+	return EXIT_FAILURE;
+}
 
-// doDivide = 1 --> divide added images by upper - lower + 1 for deformable atlas
-// doDivide = 0 --> just output the added images from lower to upper (for distributed runs,
-// eg run1: lower = 1 and upper = 11; run2: lower = 12 and upper = 21)
-ImageWriterType::Pointer writer = ImageWriterType::New() ;
+// doDivide = 1 --> divide added images by the number of images added for deformable atlas
+// doDivide = 0 --> just output the added images from lower to upper as a shard (for distributed runs,
+// eg run1: lower = 1 and upper = 11; run2: lower = 12 and upper = 21; then ./Setup merge d d1_11intermediate.nrrd d12_21intermediate.nrrd)
+// NIfTI can't be written in slabs
 if (doDivide) {
-	std::cout << "dividing added images " + lo + " to " + up + " by " << lower-upper+1 << std::endl;
-	DivideFilterType::Pointer divFilter = DivideFilterType::New();
-	divFilter->SetInput(dAddFilter->GetOutput());
-	divFilter->SetConstant(upper - lower + 1);
-	divFilter->Update();
-	std::string dname = lo + "_" + up + "deformableAtlas" + ".nii.gz";
+	std::cout << "dividing added images " + lo + " to " + up + " by " << dAccumulator.GetCount() << std::endl;
+	std::string dname = lo + "_" + up + "deformableAtlas" + (streamed ? ".mha" : ".nii.gz");
 	std::cout << "writing " + dname + "..." << std::endl;
-	writer->SetFileName( dname ) ;
-	writer->SetInput( divFilter->GetOutput()) ;
-	writer->Update();
+	dAccumulator.WriteAverage(dname);
 	std::cout << "wrote " + dname << std::endl;
  } else {
-	// just write added images
-	std::string dname = "d" + lo + "_" + up + "intermediate.nii.gz";
+	// just write added images, with the subject count and IDs in the header
+	std::string dname = "d" + lo + "_" + up + "intermediate" + (streamed ? ".mha" : ".nrrd");
 	std::cout << "writing " + dname + "..." << std::endl;
-	writer->SetFileName( dname ) ;
-	writer->SetInput( dAddFilter->GetOutput() ) ;
-	writer->Update();
-	std::cout << "wrote " + dname << std::endl;
+	dAccumulator.WriteShard(dname, "d");
+	std::cout << "wrote " + dname << " (" << dAccumulator.GetCount() << " images)" << std::endl;
 }
 // done with deformable registration 
  return 0;